@@ -0,0 +1,41 @@
+#ifndef BLOCK_H_
+#define BLOCK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jbod.h"
+
+/* Kernels over whole JBOD_BLOCK_SIZE blocks. Each has a plain C version and,
+ * on x86-64, SSE2 and AVX2 versions. The first call to any of them picks the
+ * fastest one for each kernel separately, among those the CPU supports. */
+
+typedef enum {
+  BLOCK_IMPL_AUTO,
+  BLOCK_IMPL_GENERIC,
+  BLOCK_IMPL_SSE2,
+  BLOCK_IMPL_AVX2,
+} block_impl_t;
+
+/* Copies the block at |src| to |dst|. The two must not overlap. */
+void block_copy(uint8_t *dst, const uint8_t *src);
+
+/* Completes a partially written block: every byte of |dst| whose |keep| byte
+ * is zero is replaced by the same byte of |src|. */
+void block_merge(uint8_t *dst, const uint8_t *src, const uint8_t *keep);
+
+/* Returns true if the blocks at |a| and |b| hold the same bytes. */
+bool block_equal(const uint8_t *a, const uint8_t *b);
+
+/* Returns true if every byte of the block at |buf| is the same. */
+bool block_uniform(const uint8_t *buf);
+
+/* Returns 1 on success and -1 if the CPU lacks |impl|. Switches every kernel
+ * to |impl|; BLOCK_IMPL_AUTO goes back to the fastest supported ones. Not to
+ * be called while another thread may be using the kernels. */
+int block_select(block_impl_t impl);
+
+/* Returns the name of the kernels in use. */
+const char *block_impl_name(void);
+
+#endif
@@ -0,0 +1,93 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "block.h"
+#include "jbod.h"
+
+/* Times each block kernel under every implementation the CPU supports.
+ *
+ *   usage: block_bench [iterations]
+ */
+
+#define BENCH_BUFFERS 64
+
+static uint8_t src[BENCH_BUFFERS][JBOD_BLOCK_SIZE];
+static uint8_t dst[BENCH_BUFFERS][JBOD_BLOCK_SIZE];
+static uint8_t keep[BENCH_BUFFERS][JBOD_BLOCK_SIZE];
+static volatile int sink;
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *impl, const char *kernel, long iterations, double ns) {
+  printf("%-18s %-8s %8.2f ns/block %8.2f GB/s\n", impl, kernel, ns / iterations,
+         (double) iterations * JBOD_BLOCK_SIZE / ns);
+}
+
+static void bench(block_impl_t impl, long iterations) {
+  if (block_select(impl) == -1) {
+    return;
+  }
+  const char *name = block_impl_name();
+  double start;
+  int hits = 0;
+
+  start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    block_copy(dst[i % BENCH_BUFFERS], src[i % BENCH_BUFFERS]);
+  }
+  report(name, "copy", iterations, now_ns() - start);
+
+  start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    block_merge(dst[i % BENCH_BUFFERS], src[i % BENCH_BUFFERS], keep[i % BENCH_BUFFERS]);
+  }
+  report(name, "merge", iterations, now_ns() - start);
+
+  /* dst now equals src, so equal has to look at every byte. */
+  start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    hits += block_equal(dst[i % BENCH_BUFFERS], src[i % BENCH_BUFFERS]);
+  }
+  report(name, "equal", iterations, now_ns() - start);
+
+  /* Three quarters of the buffers are uniform; the rest differ only in their last byte. */
+  start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    hits += block_uniform(keep[i % BENCH_BUFFERS]);
+  }
+  report(name, "uniform", iterations, now_ns() - start);
+  sink = hits;
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = argc > 1 ? atol(argv[1]) : 4000000;
+  if (iterations <= 0) {
+    fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  srand(1);
+  for (int i = 0; i < BENCH_BUFFERS; i++) {
+    for (int j = 0; j < JBOD_BLOCK_SIZE; j++) {
+      src[i][j] = rand();
+      keep[i][j] = i % 2;
+    }
+    if (i % 4 == 1) {
+      keep[i][JBOD_BLOCK_SIZE - 1] = 0;
+    }
+  }
+
+  bench(BLOCK_IMPL_AUTO, iterations);
+  bench(BLOCK_IMPL_GENERIC, iterations);
+  bench(BLOCK_IMPL_SSE2, iterations);
+  bench(BLOCK_IMPL_AVX2, iterations);
+  return 0;
+}
@@ -3,19 +3,256 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "block.h"
 #include "cache.h"
 #include "jbod.h"
+#include "util.h"
+
+#define CACHE_SNAPSHOT_MAGIC 0x4a424443  /* "JBDC" */
+#define CACHE_SNAPSHOT_VERSION 3
+
+/* Header at the start of the snapshot file. The cache entries and then the block store follow it
+   directly, so when a snapshot file is set the cache is the mapping itself and saving it costs
+   one msync. */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_entries;
+  uint32_t clean;       /* set by cache_destroy, cleared again while the cache is in use */
+  uint64_t generation;  /* array generation the contents were saved against; 0 if unknown */
+  uint32_t checksum;    /* crc32c of the entries and block store */
+  uint32_t reserved;
+} cache_snapshot_t;
 
 static cache_entry_t *cache = NULL;
 static int cache_size = 0;
+
+/* Payloads of the non-uniform entries. Without a snapshot file it starts small and grows on
+   demand, so duplicate and uniform blocks cost no payload memory at all. */
+static cache_block_t *blocks = NULL;
+static int blocks_capacity = 0;
 static int num_queries = 0;
 static int num_hits = 0;
 
+/* Disks are grouped into partitions, each with a minimum and maximum number of entries. A partition
+   at its maximum only replaces its own blocks, and other partitions never evict its blocks while it
+   is at or below its minimum. Every disk starts out in the shared default partition, which has no
+   quota, so without any quotas set the cache behaves as one pool. */
+#define CACHE_DEFAULT_PARTITION CACHE_MAX_PARTITIONS
+
+typedef struct {
+  int min_entries;
+  int max_entries;
+  int num_queries;
+  int num_hits;
+} cache_partition_t;
+
+static int disk_partition[JBOD_NUM_DISKS] = {
+  [0 ... JBOD_NUM_DISKS - 1] = CACHE_DEFAULT_PARTITION
+};
+static cache_partition_t partitions[CACHE_MAX_PARTITIONS + 1] = {
+  [0 ... CACHE_MAX_PARTITIONS] = { 0, INT_MAX, 0, 0 }
+};
+
+/* Miss-ratio curve, built SHARDS-style: only keys whose hash falls under MRC_THRESHOLD out of
+   MRC_MODULUS are tracked, and their LRU stack distances are scaled back up by the sampling rate.
+   mrc_hist[d] counts sampled references with scaled stack distance d; references to keys not seen
+   before (or further away than the largest possible cache) only count in mrc_refs. */
+#define MRC_MODULUS 1024
+#define MRC_THRESHOLD 128
+#define MRC_MAX_SIZE CACHE_MAX_ENTRIES
+#define MRC_ADAPT_INTERVAL 4096
+
+static uint16_t mrc_stack[JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK];
+static int mrc_depth = 0;
+static int mrc_hist[MRC_MAX_SIZE];
+static int mrc_refs = 0;
+
+/* Target for cache_adapt; no resizing happens while target_hit_rate is 0. */
+static double target_hit_rate = 0;
+static int max_entries = MRC_MAX_SIZE;
+static int num_resizes = 0;
+
+/* Version of the array the cache's contents are known to match, recorded by cache_set_generation
+   on a clean unmount; 0 while the array is mounted, since it changes with every write. */
+static uint64_t array_generation = 0;
+
+static const char *snapshot_path = NULL;
+static cache_snapshot_t *snapshot = NULL;
+static size_t snapshot_len = 0;
+
+/* This function maps the snapshot file and points the cache at the entries inside it.  The old
+   contents are kept only if the file was saved cleanly with the same number of entries and its
+   checksum still matches; anything else starts cold.  Whether the array still holds what was
+   saved is only known at mount, when cache_check_generation compares generations. */
+static int cache_map_snapshot(int num_entries) {
+  int fd = open(snapshot_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    return -1;
+  }
+
+  size_t data_len = num_entries * (sizeof(cache_entry_t) + sizeof(cache_block_t));
+  size_t len = sizeof(cache_snapshot_t) + data_len;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || ((size_t) st.st_size != len && ftruncate(fd, len) == -1)) {
+    close(fd);
+    return -1;
+  }
+
+  void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  snapshot = map;
+  snapshot_len = len;
+  cache = (cache_entry_t *) (snapshot + 1);
+  blocks = (cache_block_t *) (cache + num_entries);
+  blocks_capacity = num_entries;
+
+  bool warm = (size_t) st.st_size == len &&
+              snapshot->magic == CACHE_SNAPSHOT_MAGIC &&
+              snapshot->version == CACHE_SNAPSHOT_VERSION &&
+              snapshot->num_entries == (uint32_t) num_entries &&
+              snapshot->clean == 1 &&
+              snapshot->checksum == crc32c((uint8_t *) cache, data_len);
+  if (warm) {
+    array_generation = snapshot->generation;
+    debug_log("cache: warm start from %s (generation %lu)", snapshot_path, (unsigned long) array_generation);
+  }
+  else {
+    for (int i = 0; i < num_entries; i++) {
+      cache[i].valid = false;
+      blocks[i].refcount = 0;
+    }
+    snapshot->magic = CACHE_SNAPSHOT_MAGIC;
+    snapshot->version = CACHE_SNAPSHOT_VERSION;
+    snapshot->num_entries = num_entries;
+    array_generation = 0;
+  }
+
+  /* Anything from here until cache_destroy may leave the entries half-updated. */
+  snapshot->clean = 0;
+  return 1;
+}
+
+/* This function seals the snapshot with a fresh checksum and the array generation and unmaps it. */
+static void cache_save_snapshot(void) {
+  snapshot->checksum = crc32c((uint8_t *) cache, cache_size * (sizeof(cache_entry_t) + sizeof(cache_block_t)));
+  snapshot->generation = array_generation;
+  snapshot->clean = 1;
+  msync(snapshot, snapshot_len, MS_SYNC);
+  munmap(snapshot, snapshot_len);
+  snapshot = NULL;
+  snapshot_len = 0;
+}
+
+/* This function finds a free slot in the block store, growing it if it is full.  Returns -1 if
+   the store cannot grow. */
+static int block_alloc(void) {
+  for (int i = 0; i < blocks_capacity; i++) {
+    if (blocks[i].refcount == 0) {
+      return i;
+    }
+  }
+  if (snapshot != NULL || blocks_capacity == cache_size) {
+    return -1;
+  }
+
+  int capacity = blocks_capacity == 0 ? 16 : blocks_capacity * 2;
+  if (capacity > cache_size) {
+    capacity = cache_size;
+  }
+  cache_block_t *grown = realloc(blocks, capacity * sizeof(cache_block_t));
+  if (grown == NULL) {
+    return -1;
+  }
+  for (int i = blocks_capacity; i < capacity; i++) {
+    grown[i].refcount = 0;
+  }
+  int slot = blocks_capacity;
+  blocks = grown;
+  blocks_capacity = capacity;
+  return slot;
+}
+
+/* This function drops the entry's reference to its payload, if it has one. */
+static void entry_release(cache_entry_t *e) {
+  if (e->valid && !e->uniform) {
+    blocks[e->slot].refcount--;
+  }
+}
+
+/* This function stores |buf| as the contents of an entry: as a fill byte if the block is uniform,
+   otherwise in a slot of the block store, shared with any other entry that holds the same bytes.
+   The entry must not be holding a reference already.  Returns 1 on success and -1 on failure. */
+static int entry_store(cache_entry_t *e, const uint8_t *buf) {
+  if (block_uniform(buf)) {
+    e->uniform = true;
+    e->fill = buf[0];
+    return 1;
+  }
+
+  uint32_t hash = crc32c(buf, JBOD_BLOCK_SIZE);
+  for (int i = 0; i < blocks_capacity; i++) {
+    if (blocks[i].refcount > 0 && blocks[i].hash == hash && block_equal(blocks[i].block, buf)) {
+      blocks[i].refcount++;
+      e->uniform = false;
+      e->slot = i;
+      return 1;
+    }
+  }
+
+  int slot = block_alloc();
+  if (slot == -1) {
+    return -1;
+  }
+  blocks[slot].refcount = 1;
+  blocks[slot].hash = hash;
+  block_copy(blocks[slot].block, buf);
+  e->uniform = false;
+  e->slot = slot;
+  return 1;
+}
+
+/* This function copies the contents of an entry into |buf|. */
+static void entry_load(const cache_entry_t *e, uint8_t *buf) {
+  if (e->uniform) {
+    memset(buf, e->fill, JBOD_BLOCK_SIZE);
+  }
+  else {
+    block_copy(buf, blocks[e->slot].block);
+  }
+}
+
+/* This function sets the file cache_create maps the cache from and cache_destroy saves it to.
+   It has to be called before the cache is created. */
+int cache_set_snapshot_file(const char *path) {
+  if (cache != NULL) {
+    return -1;
+  }
+  snapshot_path = path;
+  return 1;
+}
+
 /* This function creates the cache based on the number of entries selected.  It uses malloc() to set aside space
    and then uses a for loop to rectify garbage values.*/
 int cache_create(int num_entries) {
-    if (cache == NULL && num_entries >= 2 && num_entries <= 4096) {
+    if (cache == NULL && num_entries >= 2 && num_entries <= CACHE_MAX_ENTRIES) {
+      if (snapshot_path != NULL) {
+        if (cache_map_snapshot(num_entries) == -1) {
+          return -1;
+        }
+        cache_size = num_entries;
+        return 1;
+      }
       cache_size = num_entries;
       cache = malloc(cache_size*sizeof(cache_entry_t));
       for (int i = 0; i < num_entries; i++) {
@@ -30,11 +267,19 @@ int cache_create(int num_entries) {
 }
 
 /* This function is used to destroy any previously created caches.  Cache size is then set to 0 and the cache buffer
-   is freed.*/
+   is freed, or saved to the snapshot file if one is set.*/
 int cache_destroy(void) {
     if (cache != NULL) {
-      free(cache);
+      if (snapshot != NULL) {
+        cache_save_snapshot();
+      }
+      else {
+        free(cache);
+        free(blocks);
+      }
       cache = NULL;
+      blocks = NULL;
+      blocks_capacity = 0;
       cache_size = 0;
       return 1;
     }
@@ -43,6 +288,132 @@ int cache_destroy(void) {
     }
 }
 
+/* This function records a reference to a block in the miss-ratio curve if its key is sampled. */
+static void mrc_access(int disk_num, int block_num) {
+  uint16_t key = disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num;
+  uint32_t hash = (key * 2654435761u) >> 16;
+  if (hash % MRC_MODULUS >= MRC_THRESHOLD) {
+    return;
+  }
+
+  mrc_refs++;
+  int pos = 0;
+  while (pos < mrc_depth && mrc_stack[pos] != key) {
+    pos++;
+  }
+  if (pos < mrc_depth) {
+    int distance = pos * MRC_MODULUS / MRC_THRESHOLD;
+    if (distance < MRC_MAX_SIZE) {
+      mrc_hist[distance]++;
+    }
+  }
+  else {
+    mrc_depth++;
+  }
+  memmove(&mrc_stack[1], &mrc_stack[0], pos * sizeof(mrc_stack[0]));
+  mrc_stack[0] = key;
+}
+
+/* This function predicts the hit rate an LRU cache of |num_entries| entries would have had on the
+   references seen so far. */
+double cache_predict_hit_rate(int num_entries) {
+  if (mrc_refs == 0) {
+    return 0;
+  }
+  if (num_entries > MRC_MAX_SIZE) {
+    num_entries = MRC_MAX_SIZE;
+  }
+  int hits = 0;
+  for (int d = 0; d < num_entries; d++) {
+    hits += mrc_hist[d];
+  }
+  return (double) hits / mrc_refs;
+}
+
+/* This function orders entries by how often they have been used, most used first. */
+static int compare_accesses(const void *a, const void *b) {
+  return ((const cache_entry_t *) b)->num_accesses - ((const cache_entry_t *) a)->num_accesses;
+}
+
+/* This function changes the number of cache entries, keeping the most used blocks.  A cache
+   backed by a snapshot file has a fixed size. */
+int cache_resize(int num_entries) {
+  if (!cache_enabled() || snapshot != NULL || num_entries < 2 || num_entries > CACHE_MAX_ENTRIES) {
+    return -1;
+  }
+  if (num_entries == cache_size) {
+    return 1;
+  }
+
+  cache_entry_t *old = cache;
+  cache_block_t *old_blocks = blocks;
+  int old_size = cache_size;
+
+  cache = malloc(num_entries * sizeof(cache_entry_t));
+  if (cache == NULL) {
+    cache = old;
+    return -1;
+  }
+  for (int i = 0; i < num_entries; i++) {
+    cache[i].valid = false;
+  }
+  cache_size = num_entries;
+  blocks = NULL;
+  blocks_capacity = 0;
+
+  qsort(old, old_size, sizeof(cache_entry_t), compare_accesses);
+  int kept = 0;
+  for (int i = 0; i < old_size && kept < num_entries; i++) {
+    if (!old[i].valid) {
+      continue;
+    }
+    uint8_t buf[JBOD_BLOCK_SIZE];
+    if (old[i].uniform) {
+      memset(buf, old[i].fill, JBOD_BLOCK_SIZE);
+    }
+    else {
+      block_copy(buf, old_blocks[old[i].slot].block);
+    }
+    if (entry_store(&cache[kept], buf) == -1) {
+      break;
+    }
+    cache[kept].valid = true;
+    cache[kept].disk_num = old[i].disk_num;
+    cache[kept].block_num = old[i].block_num;
+    cache[kept].num_accesses = old[i].num_accesses;
+    kept++;
+  }
+
+  free(old);
+  free(old_blocks);
+  num_resizes++;
+  return 1;
+}
+
+/* This function sets a hit rate (between 0 and 1) the cache should resize itself towards, never
+   growing beyond |limit| entries.  A target of 0 turns resizing off. */
+void cache_set_target(double hit_rate, int limit) {
+  target_hit_rate = hit_rate;
+  max_entries = limit < MRC_MAX_SIZE ? limit : MRC_MAX_SIZE;
+}
+
+/* This function resizes the cache to the smallest size the miss-ratio curve says meets the
+   target hit rate.  Sizes within an eighth of the current one are left alone to avoid churn.
+   hits is the numerator of cache_predict_hit_rate(size) kept as a running sum, so the
+   histogram is walked once rather than once per candidate size. */
+static void cache_adapt(void) {
+  int size = 2;
+  int hits = mrc_hist[0] + mrc_hist[1];
+  while (size < max_entries && (mrc_refs == 0 || (double) hits / mrc_refs < target_hit_rate)) {
+    hits += mrc_hist[size];
+    size++;
+  }
+  if (abs(size - cache_size) > cache_size / 8) {
+    debug_log("cache: resizing from %d to %d entries", cache_size, size);
+    cache_resize(size);
+  }
+}
+
 /*This function examines the cache to see whether a particular disk number and block number is stored in the cache.
   If so, the cache is then placed into the buffer inputted into the function.*/
 int cache_lookup(int disk_num, int block_num, uint8_t *buf) {
@@ -55,11 +426,17 @@ int cache_lookup(int disk_num, int block_num, uint8_t *buf) {
   }
 
   num_queries++;
+  partitions[disk_partition[disk_num]].num_queries++;
+  mrc_access(disk_num, block_num);
+  if (target_hit_rate > 0 && num_queries % MRC_ADAPT_INTERVAL == 0) {
+    cache_adapt();
+  }
   
   for (int i = 0; i < cache_size; i++) {
     if (cache[i].valid == true && disk_num == cache[i].disk_num && block_num == cache[i].block_num) {
-      memcpy(buf, cache[i].block, JBOD_BLOCK_SIZE);
+      entry_load(&cache[i], buf);
       num_hits++;
+      partitions[disk_partition[disk_num]].num_hits++;
       cache[i].num_accesses++;
       return 1;
     }
@@ -67,16 +444,138 @@ int cache_lookup(int disk_num, int block_num, uint8_t *buf) {
   return -1;
 }
 
+/* This function checks whether a block is cached without touching the hit counters, for callers
+   that are deciding whether to fetch it rather than reading it. */
+bool cache_contains(int disk_num, int block_num) {
+  if (!cache_enabled()) {
+    return false;
+  }
+  for (int i = 0; i < cache_size; i++) {
+    if (cache[i].valid == true && disk_num == cache[i].disk_num && block_num == cache[i].block_num) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* This function records the array generation the cache's contents match, once nothing can change
+   the array any more: on a clean unmount. */
+void cache_set_generation(uint64_t generation) {
+  array_generation = generation;
+}
+
+/* This function empties the cache unless its contents were recorded against the generation the
+   array has now, and in any case forgets the recorded one until the next clean unmount. */
+int cache_check_generation(uint64_t generation) {
+  if (!cache_enabled()) {
+    return -1;
+  }
+  bool keep = generation != 0 && generation == array_generation;
+  array_generation = 0;
+  int kept = 0;
+  for (int i = 0; i < cache_size; i++) {
+    if (cache[i].valid && !keep) {
+      entry_release(&cache[i]);
+      cache[i].valid = false;
+    }
+    kept += cache[i].valid;
+  }
+  return kept;
+}
+
+/* This function lists the blocks the cache holds as disk << 8 | block keys and returns how many
+   there are. */
+int cache_blocks(uint16_t *keys) {
+  int n = 0;
+  for (int i = 0; cache_enabled() && i < cache_size; i++) {
+    if (cache[i].valid) {
+      keys[n++] = cache[i].disk_num << 8 | cache[i].block_num;
+    }
+  }
+  return n;
+}
+
+/* This function copies a cached block into buf without counting it as a query or an access, for
+   callers that only want to check what the cache holds.  Returns 1 if the block is cached and -1
+   if not. */
+int cache_peek(int disk_num, int block_num, uint8_t *buf) {
+  if (!cache_enabled()) {
+    return -1;
+  }
+  for (int i = 0; i < cache_size; i++) {
+    if (cache[i].valid == true && disk_num == cache[i].disk_num && block_num == cache[i].block_num) {
+      entry_load(&cache[i], buf);
+      return 1;
+    }
+  }
+  return -1;
+}
+
+/* This function drops a block from the cache, for when its contents were changed behind the
+   cache's back. */
+void cache_invalidate(int disk_num, int block_num) {
+  for (int i = 0; i < cache_size; i++) {
+    if (cache[i].valid == true && disk_num == cache[i].disk_num && block_num == cache[i].block_num) {
+      entry_release(&cache[i]);
+      cache[i].valid = false;
+      return;
+    }
+  }
+}
+
 /*This function updates the content of the cache if the block and disk number exist inside.*/
 void cache_update(int disk_num, int block_num, const uint8_t *buf) {
   for (int i = 0; i < cache_size; i++) {
     if (cache[i].valid == true && disk_num == cache[i].disk_num && cache[i].block_num == block_num) {
-      memcpy(cache[i].block, buf, JBOD_BLOCK_SIZE);
+      entry_release(&cache[i]);
+      if (entry_store(&cache[i], buf) == -1) {
+        cache[i].valid = false;
+        return;
+      }
       cache[i].num_accesses = 1;
     }
   }
 }
 
+/* This function picks the least used entry that may be evicted to make room for partition |part|:
+   one of its own entries if |own_only|, otherwise one from any partition above its minimum.
+   |used| holds the number of entries each partition has.  Returns -1 if there is none. */
+static int lfu_victim(int part, const int *used, bool own_only) {
+  int victim = -1;
+  for (int i = 0; i < cache_size; i++) {
+    if (cache[i].valid == false) {
+      continue;
+    }
+    int owner = disk_partition[cache[i].disk_num];
+    if (own_only ? owner != part : used[owner] <= partitions[owner].min_entries) {
+      continue;
+    }
+    if (victim == -1 || cache[victim].num_accesses > cache[i].num_accesses) {
+      victim = i;
+    }
+  }
+  return victim;
+}
+
+/* This function moves a disk into a partition; its cached blocks move with it. */
+int cache_set_partition(int disk_num, int partition) {
+  if (disk_num < 0 || disk_num >= JBOD_NUM_DISKS || partition < 0 || partition >= CACHE_MAX_PARTITIONS) {
+    return -1;
+  }
+  disk_partition[disk_num] = partition;
+  return 1;
+}
+
+/* This function sets the minimum and maximum number of entries of a partition. */
+int cache_set_quota(int partition, int min_entries, int max_entries) {
+  if (partition < 0 || partition >= CACHE_MAX_PARTITIONS || min_entries < 0 || max_entries < min_entries) {
+    return -1;
+  }
+  partitions[partition].min_entries = min_entries;
+  partitions[partition].max_entries = max_entries;
+  return 1;
+}
+
 /*This function alows you to insert items into the cache.  This can only be done if the disknum and blocknum
   doesn't exist in the cache.*/
 int cache_insert(int disk_num, int block_num, const uint8_t *buf) {
@@ -89,42 +588,65 @@ int cache_insert(int disk_num, int block_num, const uint8_t *buf) {
     return -1;
   }
 
-  if (block_num > 255 || block_num < 0) {
+  if (block_num >= JBOD_NUM_BLOCKS_PER_DISK || block_num < 0) {
     return -1;
   }
 
-  if (disk_num > 15 || disk_num < 0) {
+  if (disk_num >= JBOD_NUM_DISKS || disk_num < 0) {
     return -1;
   }
 
-  int min_accesses = 0;
-
   for (int i = 0; i < cache_size; i++) {
     if (cache[i].valid == true && cache[i].block_num == block_num && cache[i].disk_num == disk_num) {
       return -1;
     }
   }
 
+  int part = disk_partition[disk_num];
+  int used[CACHE_MAX_PARTITIONS + 1] = {0};
+  int free_slot = -1;
   for (int i = 0; i < cache_size; i++) {
-    if (cache[i].valid == false) {
-      cache[i].valid = true;
-      cache[i].disk_num = disk_num;
-      cache[i].block_num = block_num;
-      memcpy(cache[i].block, buf, JBOD_BLOCK_SIZE);
-      cache[i].num_accesses = 1;
-      return 1;
+    if (cache[i].valid == true) {
+      used[disk_partition[cache[i].disk_num]]++;
     }
-    else if (cache[min_accesses].num_accesses > cache[i].num_accesses) {
-      min_accesses = i;
+    else if (free_slot == -1) {
+      free_slot = i;
     }
   }
 
-    memcpy(cache[min_accesses].block, buf, JBOD_BLOCK_SIZE);
-    cache[min_accesses].num_accesses = 1;
-    cache[min_accesses].disk_num = disk_num;
-    cache[min_accesses].block_num = block_num;
+  /* A partition above its minimum pays for its own inserts; only one at or below it takes a
+     block from the others. */
+  int slot;
+  if (used[part] >= partitions[part].max_entries) {
+    slot = lfu_victim(part, used, true);
+  }
+  else if (free_slot != -1) {
+    slot = free_slot;
+  }
+  else if (used[part] > partitions[part].min_entries) {
+    slot = lfu_victim(part, used, true);
+  }
+  else {
+    slot = lfu_victim(part, used, false);
+    if (slot == -1) {
+      slot = lfu_victim(part, used, true);
+    }
+  }
+  if (slot == -1) {
+    return -1;
+  }
 
-    return 1;
+  entry_release(&cache[slot]);
+  if (entry_store(&cache[slot], buf) == -1) {
+    cache[slot].valid = false;
+    return -1;
+  }
+  cache[slot].valid = true;
+  cache[slot].disk_num = disk_num;
+  cache[slot].block_num = block_num;
+  cache[slot].num_accesses = 1;
+
+  return 1;
 }
 
 /* This function checkes whether or not the cache is enabled.*/
@@ -137,3 +659,53 @@ void cache_print_hit_rate(void) {
 	fprintf(stderr, "num_hits: %d, num_queries: %d\n", num_hits, num_queries);
 	fprintf(stderr, "Hit rate: %5.1f%%\n", 100 * (float) num_hits / num_queries);
 }
+
+/* This function prints the predicted hit rate at every power-of-two cache size. */
+void cache_print_mrc(void) {
+  fprintf(stderr, "Predicted hit rate (1/%d of keys sampled):", MRC_MODULUS / MRC_THRESHOLD);
+  for (int size = 2; size <= MRC_MAX_SIZE; size *= 2) {
+    fprintf(stderr, " %d:%.1f%%", size, 100 * cache_predict_hit_rate(size));
+  }
+  fprintf(stderr, "\n");
+  if (num_resizes > 0) {
+    fprintf(stderr, "resizes: %d, final size: %d\n", num_resizes, cache_size);
+  }
+}
+
+/* This function prints the hit rate and occupancy of every partition that has seen lookups. */
+void cache_print_partitions(void) {
+  for (int p = 0; p <= CACHE_MAX_PARTITIONS; p++) {
+    if (partitions[p].num_queries == 0) {
+      continue;
+    }
+    int entries = 0;
+    for (int i = 0; i < cache_size; i++) {
+      entries += cache[i].valid && disk_partition[cache[i].disk_num] == p;
+    }
+    if (p == CACHE_DEFAULT_PARTITION) {
+      fprintf(stderr, "partition default:");
+    }
+    else {
+      fprintf(stderr, "partition %d:", p);
+    }
+    fprintf(stderr, " entries: %d, num_hits: %d, num_queries: %d, hit rate: %5.1f%%\n",
+            entries, partitions[p].num_hits, partitions[p].num_queries,
+            100 * (float) partitions[p].num_hits / partitions[p].num_queries);
+  }
+}
+
+/* This function prints how compactly the cached blocks are stored. */
+void cache_print_storage(void) {
+  int entries = 0, uniform = 0, payloads = 0;
+  for (int i = 0; i < cache_size; i++) {
+    if (cache[i].valid) {
+      entries++;
+      uniform += cache[i].uniform;
+    }
+  }
+  for (int i = 0; i < blocks_capacity; i++) {
+    payloads += blocks[i].refcount > 0;
+  }
+  fprintf(stderr, "cached_blocks: %d, uniform: %d, shared: %d, payloads: %d\n",
+          entries, uniform, entries - uniform - payloads, payloads);
+}
@@ -7,14 +7,31 @@
 #include "jbod.h"
 #include "util.h"
 
+/* Number of partitions that disks can be assigned to with cache_set_partition. */
+#define CACHE_MAX_PARTITIONS JBOD_NUM_DISKS
+
+/* A cache never needs more entries than the array has blocks. */
+#define CACHE_MAX_ENTRIES (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+
+/* A block is stored either as a fill byte, when all of its bytes are the same,
+ * or as a reference to a slot in the block store, which is shared by every
+ * entry holding the same contents. */
 typedef struct {
   bool valid;
+  bool uniform;
+  uint8_t fill;
   int disk_num;
   int block_num;
-  uint8_t block[JBOD_BLOCK_SIZE];
+  int slot;
   int num_accesses;
 } cache_entry_t;
 
+typedef struct {
+  int refcount;
+  uint32_t hash;
+  uint8_t block[JBOD_BLOCK_SIZE];
+} cache_block_t;
+
 /* Returns 1 on success and -1 on failure. Should allocate a space for
  * |num_entries| cache entries, each of type cache_entry_t. Calling it again
  * without first calling cache_destroy (see below) should fail. */
@@ -24,11 +41,40 @@ int cache_create(int num_entries);
  * cache_create function above. */
 int cache_destroy(void);
 
+/* Returns 1 on success and -1 on failure. Makes cache_create map the cache
+ * from the file at |path| and cache_destroy save it back there, so a restart
+ * with the same number of entries begins with a warm cache. The contents are
+ * only reused if the file was saved cleanly, its checksum matches and, at the
+ * next mount, cache_check_generation finds the array unchanged. Must be called
+ * before cache_create. */
+int cache_set_snapshot_file(const char *path);
+
 /* Returns 1 on success and -1 on failure. Looks up the block located at
  * |disk_num| and |block_num| in cache and if found, copies the corresponding
  * block to |buf|, which must not be NULL. */
 int cache_lookup(int disk_num, int block_num, uint8_t *buf);
 
+/* Returns true if the block at |disk_num| and |block_num| is in the cache.
+ * Unlike cache_lookup this does not count as a query. */
+bool cache_contains(int disk_num, int block_num);
+
+/* Records |generation| as the version of the array the cache's contents match.
+ * Called on a clean unmount; it is saved with the snapshot. 0 means unknown. */
+void cache_set_generation(uint64_t generation);
+
+/* Called on mount with the array's current |generation| (0 if unknown).
+ * Empties the cache unless its contents were recorded against that same
+ * generation. Returns the number of entries kept, or -1 without a cache. */
+int cache_check_generation(uint64_t generation);
+
+/* Stores the disk << 8 | block key of every cached block in |keys|, which
+ * must have room for CACHE_MAX_ENTRIES, and returns how many there are. */
+int cache_blocks(uint16_t *keys);
+
+/* Returns 1 and copies the block into |buf| if it is in the cache, -1 if not.
+ * Like cache_contains this does not count as a query. */
+int cache_peek(int disk_num, int block_num, uint8_t *buf);
+
 /* Returns 1 on success and -1 on failure. Inserts an entry for |disk_num| and
  * |block_num| into cache. Returns -1 if there is already an existing entry in the cache
  * with |disk_num| and |block_num|.If there cache is full, should evict least
@@ -39,10 +85,51 @@ int cache_insert(int disk_num, int block_num, const uint8_t *buf);
  * corresponding block with data from |buf| */
 void cache_update(int disk_num, int block_num, const uint8_t *buf);
 
+/* Removes the entry with |disk_num| and |block_num|, if there is one, because
+ * the block has been overwritten by someone else. */
+void cache_invalidate(int disk_num, int block_num);
+
+/* Returns 1 on success and -1 on failure. Moves |disk_num| into |partition|
+ * (0 to CACHE_MAX_PARTITIONS - 1). Disks start out in a shared default
+ * partition without a quota. */
+int cache_set_partition(int disk_num, int partition);
+
+/* Returns 1 on success and -1 on failure. Gives |partition| a quota: it never
+ * holds more than |max_entries| entries, and once the cache is full it evicts
+ * its own blocks while it holds more than |min_entries|. Below that it evicts
+ * from partitions above their minimum, which never lose blocks to others
+ * while they hold |min_entries| or fewer. */
+int cache_set_quota(int partition, int min_entries, int max_entries);
+
 /* Returns true if cache is enabled and false if not. */
 bool cache_enabled(void);
 
 /* Prints the hit rate of the cache. */
 void cache_print_hit_rate(void);
 
+/* Returns the hit rate, between 0 and 1, that an LRU cache of |num_entries|
+ * entries is predicted to reach on the lookups seen so far, from a sampled
+ * miss-ratio curve. */
+double cache_predict_hit_rate(int num_entries);
+
+/* Returns 1 on success and -1 on failure. Changes the number of entries of
+ * the cache, keeping the most used blocks. Fails for a cache backed by a
+ * snapshot file. */
+int cache_resize(int num_entries);
+
+/* Makes the cache periodically resize itself to the smallest size predicted
+ * to reach |hit_rate| (between 0 and 1), but never beyond |limit| entries.
+ * A |hit_rate| of 0 turns this off. */
+void cache_set_target(double hit_rate, int limit);
+
+/* Prints the predicted hit rate at every power-of-two cache size. */
+void cache_print_mrc(void);
+
+/* Prints the hit rate and occupancy of each partition. */
+void cache_print_partitions(void);
+
+/* Prints how many cached blocks are stored as fill bytes or share a payload
+ * with another entry. */
+void cache_print_storage(void);
+
 #endif
@@ -0,0 +1,647 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <err.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "cache.h"
+#include "cache_server.h"
+#include "jbod.h"
+#include "net.h"
+#include "util.h"
+
+/* A JBOD server that speaks the same protocol as jbod_server, with one block cache in front of
+   the JBOD shared by every client.  Reads that hit are answered without touching the JBOD;
+   writes go through to the JBOD and replace the cached copy, so the cache never holds a block
+   older than the JBOD's.  Clients' own caches are kept coherent by invalidations the server
+   pushes to them (see INFO_INVALIDATIONS in net.h). */
+
+#define SERVER_ARGUMENTS "hp:s:a:q:um"
+#define USAGE                                                                                      \
+  "USAGE: cache_server [-h] [-p port] [-s cache_size] [-a target-hit-rate] [-q disk:min:max]\n"  \
+  "                    [-u] [-m]\n"                                                              \
+  "\n"                                                                                             \
+  "where:\n"                                                                                       \
+  "    -h - help mode (display this message)\n"                                                    \
+  "    -p - listen on port (default 3333)\n"                                                       \
+  "    -u - also listen on the Unix domain socket " JBOD_SOCKET_PATH "\n"                          \
+  "    -m - also serve one client at a time over the shared memory object " JBOD_SHM_NAME "\n"     \
+  "    -s - entries in the shared cache (default 1024)\n"                                          \
+  "    -a - resize the cache towards target-hit-rate percent, up to cache_size entries\n"          \
+  "    -q - give disk its own cache partition of min to max entries (repeatable)\n"               \
+  "\n"                                                                                             \
+  "Statistics are printed whenever a client disconnects and on SIGINT or SIGTERM.\n"
+
+/* The JBOD, the cache and everything below are shared by the client threads. */
+static pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int cache_size = CACHE_SERVER_DEFAULT_ENTRIES;
+static int mount_count = 0;
+static int writable_count = 0;
+static int head_disk = -1;
+static int head_block = -1;
+
+/* Changes whenever the array's contents may have (see JBOD_GET_GENERATION in net.h).  A fresh
+   random value on every JBOD mount, since mounting the JBOD wipes it. */
+static uint64_t array_generation = 0;
+
+static server_client_t *clients = NULL;
+static int num_clients = 0;
+static long num_requests = 0;
+static long num_reads = 0;
+static long num_jbod_reads = 0;
+static long num_writes = 0;
+static long num_fills = 0;
+static long num_invalidations = 0;
+static long num_pushes = 0;
+
+static volatile sig_atomic_t stopping = 0;
+
+static uint32_t encode_op(jbod_cmd_t cmd, int disk_num, int block_num) {
+  return cmd << 12 | disk_num << 8 | block_num;
+}
+
+/* Moves the real head onto a block, skipping whichever seeks are not needed. */
+static int seek_to(int disk, int block) {
+  if (disk != head_disk) {
+    if (jbod_operation(encode_op(JBOD_SEEK_TO_DISK, disk, 0), NULL) == -1) {
+      return -1;
+    }
+    head_disk = disk;
+    head_block = -1;
+  }
+  if (block != head_block) {
+    if (jbod_operation(encode_op(JBOD_SEEK_TO_BLOCK, 0, block), NULL) == -1) {
+      return -1;
+    }
+    head_block = block;
+  }
+  return 0;
+}
+
+/* Reading or writing a block leaves the head on the next one, or past the end of the disk. */
+static void head_advance(void) {
+  head_block++;
+  if (head_block == JBOD_NUM_BLOCKS_PER_DISK) {
+    head_disk = -1;
+    head_block = -1;
+  }
+}
+
+static void add_client(server_client_t *c) {
+  c->next = clients;
+  clients = c;
+  num_clients++;
+}
+
+static void remove_client(server_client_t *c) {
+  server_client_t **p = &clients;
+  while (*p != c) {
+    p = &(*p)->next;
+  }
+  *p = c->next;
+  num_clients--;
+}
+
+/* Tells every other client that may hold a block that it has just been overwritten. */
+static void invalidate_others(server_client_t *writer, int disk, int block) {
+  for (server_client_t *o = clients; o != NULL; o = o->next) {
+    if (o != writer && o->may_cache[disk][block] &&
+        o->num_pending < JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK) {
+      o->may_cache[disk][block] = false;
+      o->pending[o->num_pending++] = disk << 8 | block;
+      num_invalidations++;
+    }
+  }
+}
+
+/* Moves up to max of the client's queued invalidations into keys, oldest first, and returns how
+   many. */
+static int take_invalidations(server_client_t *c, uint16_t *keys, int max) {
+  int n = c->num_pending < max ? c->num_pending : max;
+  memcpy(keys, c->pending, n * sizeof(uint16_t));
+  c->num_pending -= n;
+  memmove(c->pending, c->pending + n, c->num_pending * sizeof(uint16_t));
+  return n;
+}
+
+/* Pushes the client's queued invalidations to it, as few packets as it takes.  Keys that do
+   not fit in a full shared memory ring stay queued for the next push. */
+static void push_invalidations(server_client_t *c) {
+  if (c->shm != NULL) {
+    jbod_shm_invalidations_t *inv = &c->shm->invalidations;
+    uint32_t head = atomic_load_explicit(&inv->head, memory_order_relaxed);
+    int room = JBOD_SHM_INVALIDATIONS - (head - atomic_load_explicit(&inv->tail, memory_order_acquire));
+    uint16_t keys[JBOD_SHM_INVALIDATIONS];
+    int n = take_invalidations(c, keys, room);
+    for (int i = 0; i < n; i++) {
+      inv->keys[(head + i) % JBOD_SHM_INVALIDATIONS] = keys[i];
+    }
+    atomic_store_explicit(&inv->head, head + n, memory_order_release);
+    num_pushes += n > 0;
+    return;
+  }
+
+  pthread_mutex_lock(&c->send_mutex);
+  while (c->num_pending > 0) {
+    uint8_t packet[HEADER_LEN + sizeof(uint16_t) * (1 + JBOD_MAX_INVALIDATIONS)];
+    uint16_t keys[JBOD_MAX_INVALIDATIONS];
+    int n = take_invalidations(c, keys, JBOD_MAX_INVALIDATIONS);
+    memset(packet, 0, HEADER_LEN);
+    packet[4] = INFO_INVALIDATIONS;
+    int len = HEADER_LEN;
+    uint16_t count = htons(n);
+    memcpy(packet + len, &count, sizeof(count));
+    len += sizeof(count);
+    for (int i = 0; i < n; i++) {
+      uint16_t key = htons(keys[i]);
+      memcpy(packet + len, &key, sizeof(key));
+      len += sizeof(key);
+    }
+    nwrite(c->sd, len, packet);
+    num_pushes++;
+  }
+  pthread_mutex_unlock(&c->send_mutex);
+}
+
+/* Pushes whatever the last request left queued for any client.  Runs under server_mutex, before
+   the writer is answered, so once a write returns every other client has its invalidation. */
+static void push_all_invalidations(void) {
+  for (server_client_t *o = clients; o != NULL; o = o->next) {
+    if (o->num_pending > 0) {
+      push_invalidations(o);
+    }
+  }
+}
+
+/* Gives up whatever the client still holds: its mount and its write permission. */
+static void release_client(server_client_t *c) {
+  if (c->writable) {
+    c->writable = false;
+    if (--writable_count == 0) {
+      jbod_operation(encode_op(JBOD_REVOKE_WRITE_PERMISSION, 0, 0), NULL);
+    }
+  }
+  if (c->mounted) {
+    c->mounted = false;
+    if (--mount_count == 0) {
+      jbod_operation(encode_op(JBOD_UNMOUNT, 0, 0), NULL);
+    }
+  }
+}
+
+/* Carries out one request for a client on its virtual head.  Mounting and write permission are
+   reference counted, so the JBOD is mounted while any client has it mounted.  Mounting wipes the
+   JBOD, so the cache is emptied whenever the first client mounts.  Returns 0 or -1 like
+   jbod_operation and sets *has_block if block holds data for the reply. */
+static int handle_request(server_client_t *c, uint32_t op, uint8_t *block, bool *has_block) {
+  int cmd = op >> 12 & 0x3f;
+  int disk = op >> 8 & 0xf;
+  int blk = op & 0xff;
+  *has_block = false;
+
+  switch (cmd) {
+    case JBOD_MOUNT:
+      if (c->mounted) {
+        return -1;
+      }
+      if (mount_count == 0) {
+        if (jbod_operation(op, NULL) == -1) {
+          return -1;
+        }
+        head_disk = -1;
+        head_block = -1;
+        array_generation = (uint64_t) get_rand(1, UINT32_MAX - 1) << 32 | get_rand(0, UINT32_MAX - 1);
+        if (cache_enabled()) {
+          cache_destroy();
+        }
+        cache_create(cache_size);
+      }
+      mount_count++;
+      c->mounted = true;
+      c->disk = 0;
+      c->block = 0;
+      return 0;
+
+    case JBOD_UNMOUNT:
+      if (!c->mounted) {
+        return -1;
+      }
+      release_client(c);
+      return 0;
+
+    case JBOD_WRITE_PERMISSION:
+      if (c->writable) {
+        return -1;
+      }
+      if (writable_count == 0 && jbod_operation(op, NULL) == -1) {
+        return -1;
+      }
+      writable_count++;
+      c->writable = true;
+      return 0;
+
+    case JBOD_REVOKE_WRITE_PERMISSION:
+      if (!c->writable) {
+        return -1;
+      }
+      c->writable = false;
+      if (--writable_count == 0) {
+        jbod_operation(op, NULL);
+      }
+      return 0;
+
+    case JBOD_SEEK_TO_DISK:
+      if (!c->mounted) {
+        return -1;
+      }
+      c->disk = disk;
+      return 0;
+
+    case JBOD_SEEK_TO_BLOCK:
+      if (!c->mounted) {
+        return -1;
+      }
+      c->block = blk;
+      return 0;
+
+    case JBOD_READ_BLOCK:
+      if (!c->mounted || c->block >= JBOD_NUM_BLOCKS_PER_DISK) {
+        return -1;
+      }
+      num_reads++;
+      if (cache_lookup(c->disk, c->block, block) != 1) {
+        if (seek_to(c->disk, c->block) == -1 || jbod_operation(op, block) == -1) {
+          return -1;
+        }
+        head_advance();
+        num_jbod_reads++;
+        cache_insert(c->disk, c->block, block);
+      }
+      c->may_cache[c->disk][c->block] = true;
+      c->block++;
+      *has_block = true;
+      return 0;
+
+    case JBOD_FILL_BLOCK:
+      /* The block is made here and written like any other. */
+      memset(block, blk, JBOD_BLOCK_SIZE);
+      op = encode_op(JBOD_WRITE_BLOCK, 0, 0);
+      num_fills++;
+      /* fall through */
+    case JBOD_WRITE_BLOCK:
+      if (!c->mounted || !c->writable || c->block >= JBOD_NUM_BLOCKS_PER_DISK) {
+        return -1;
+      }
+      if (seek_to(c->disk, c->block) == -1 || jbod_operation(op, block) == -1) {
+        return -1;
+      }
+      head_advance();
+      num_writes++;
+      array_generation++;
+      if (cache_insert(c->disk, c->block, block) == -1) {
+        cache_update(c->disk, c->block, block);
+      }
+      invalidate_others(c, c->disk, c->block);
+      c->may_cache[c->disk][c->block] = true;
+      c->block++;
+      return 0;
+
+    case JBOD_GET_GENERATION:
+      if (!c->mounted) {
+        return -1;
+      }
+      memset(block, 0, JBOD_BLOCK_SIZE);
+      for (int i = 0; i < 8; i++) {
+        block[i] = array_generation >> (56 - 8 * i);
+      }
+      *has_block = true;
+      return 0;
+
+    case JBOD_HOLD_BLOCKS:
+      if (!c->mounted || disk + JBOD_HOLD_BLOCKS_PER_OP / JBOD_NUM_BLOCKS_PER_DISK > JBOD_NUM_DISKS) {
+        return -1;
+      }
+      for (int i = 0; i < JBOD_HOLD_BLOCKS_PER_OP; i++) {
+        if (block[i / 8] & (1 << i % 8)) {
+          c->may_cache[disk + i / JBOD_NUM_BLOCKS_PER_DISK][i % JBOD_NUM_BLOCKS_PER_DISK] = true;
+        }
+      }
+      return 0;
+
+    case JBOD_SIGN_BLOCK:
+      if (jbod_operation(op, block) == -1) {
+        return -1;
+      }
+      *has_block = true;
+      return 0;
+
+    default:
+      return -1;
+  }
+}
+
+static void print_stats(void) {
+  fprintf(stderr, "clients: %d, requests: %ld, reads: %ld, jbod_reads: %ld, writes: %ld (%ld fills)\n",
+          num_clients, num_requests, num_reads, num_jbod_reads, num_writes, num_fills);
+  fprintf(stderr, "invalidations: %ld, in %ld pushes\n", num_invalidations, num_pushes);
+  if (num_reads > 0) {
+    cache_print_hit_rate();
+  }
+}
+
+/* Serves one client until it disconnects.  A client that goes away while still holding the
+   array mounted or writable gives both up. */
+static void *client_thread(void *arg) {
+  server_client_t *c = arg;
+  uint8_t header[HEADER_LEN];
+  uint8_t block[JBOD_BLOCK_SIZE];
+
+  while (nread(c->sd, HEADER_LEN, header)) {
+    uint32_t op;
+    memcpy(&op, header, sizeof(op));
+    op = ntohl(op);
+    uint8_t info = header[4];
+    if ((info & INFO_HAS_BLOCK) && !nread(c->sd, JBOD_BLOCK_SIZE, block)) {
+      break;
+    }
+
+    /* The reply is sent under send_mutex, taken before server_mutex is let go, so a push for a
+       later write cannot overtake the older block this reply may carry. */
+    bool has_block;
+    pthread_mutex_lock(&server_mutex);
+    num_requests++;
+    int rc = handle_request(c, op, block, &has_block);
+    push_all_invalidations();
+    pthread_mutex_lock(&c->send_mutex);
+    pthread_mutex_unlock(&server_mutex);
+
+    uint8_t reply[HEADER_LEN + JBOD_BLOCK_SIZE];
+    uint32_t nop = htonl(op);
+    memcpy(reply, &nop, sizeof(nop));
+    reply[4] = (rc == -1 ? INFO_FAILED : 0) | (has_block ? INFO_HAS_BLOCK : 0);
+    if (has_block) {
+      memcpy(reply + HEADER_LEN, block, JBOD_BLOCK_SIZE);
+    }
+    bool sent = nwrite(c->sd, HEADER_LEN + (has_block ? JBOD_BLOCK_SIZE : 0), reply);
+    pthread_mutex_unlock(&c->send_mutex);
+    if (!sent) {
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&server_mutex);
+  release_client(c);
+  remove_client(c);
+  print_stats();
+  pthread_mutex_unlock(&server_mutex);
+  close(c->sd);
+  pthread_mutex_destroy(&c->send_mutex);
+  free(c);
+  return NULL;
+}
+
+/* Serves the shared memory channel: takes requests off one ring, carries them out in their own
+   slots and puts the results on the other.  Runs until the server stops, treating a client that
+   detaches like one that closed its socket. */
+static void *shm_thread(void *arg) {
+  jbod_shm_channel_t *ch = arg;
+  server_client_t *c = calloc(1, sizeof(server_client_t));
+  bool attached = false;
+  long idle = 0;
+  long max_spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 1000 : 0;
+
+  while (!stopping) {
+    jbod_shm_slot_t *req = jbod_ring_peek(&ch->requests);
+    if (req == NULL) {
+      if (attached && atomic_load(&ch->attached) == 0) {
+        attached = false;
+        pthread_mutex_lock(&server_mutex);
+        release_client(c);
+        remove_client(c);
+        print_stats();
+        pthread_mutex_unlock(&server_mutex);
+      }
+      /* Spin while requests are coming in (if the client has a CPU of its own), then back off
+         to yielding and finally to sleeping. */
+      if (++idle > 100000) {
+        usleep(1000);
+      }
+      else if (idle > max_spins) {
+        sched_yield();
+      }
+      continue;
+    }
+    idle = 0;
+    if (!attached) {
+      attached = true;
+      memset(c, 0, sizeof(server_client_t));
+      c->sd = -1;
+      c->shm = ch;
+      pthread_mutex_lock(&server_mutex);
+      add_client(c);
+      pthread_mutex_unlock(&server_mutex);
+    }
+
+    /* The client never has more than JBOD_MAX_PIPELINE requests outstanding, so there is room.
+       As with a socket, the completion goes out before server_mutex is let go, ahead of any
+       later push. */
+    jbod_shm_slot_t *resp = jbod_ring_reserve(&ch->completions);
+    bool has_block;
+    pthread_mutex_lock(&server_mutex);
+    num_requests++;
+    int rc = handle_request(c, req->op, req->block, &has_block);
+    push_all_invalidations();
+    resp->op = req->op;
+    resp->info = (rc == -1 ? INFO_FAILED : 0) | (has_block ? INFO_HAS_BLOCK : 0);
+    jbod_ring_release(&ch->requests);
+    jbod_ring_publish(&ch->completions);
+    pthread_mutex_unlock(&server_mutex);
+  }
+  if (attached) {
+    pthread_mutex_lock(&server_mutex);
+    remove_client(c);
+    pthread_mutex_unlock(&server_mutex);
+  }
+  free(c);
+  return NULL;
+}
+
+/* Creates the shared memory object clients attach to with jbod_connect_shm. */
+static jbod_shm_channel_t *create_shm(const char *name) {
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1 || ftruncate(fd, sizeof(jbod_shm_channel_t)) == -1) {
+    return NULL;
+  }
+  jbod_shm_channel_t *ch = mmap(NULL, sizeof(jbod_shm_channel_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ch == MAP_FAILED) {
+    return NULL;
+  }
+  memset(ch, 0, sizeof(jbod_shm_channel_t));
+  ch->magic = JBOD_SHM_MAGIC;
+  return ch;
+}
+
+/* Opens a listening Unix domain socket at path, replacing any stale one. */
+static int listen_unix(const char *path) {
+  struct sockaddr_un uaddr;
+  memset(&uaddr, 0, sizeof(uaddr));
+  uaddr.sun_family = AF_UNIX;
+  strncpy(uaddr.sun_path, path, sizeof(uaddr.sun_path) - 1);
+
+  int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sd == -1) {
+    return -1;
+  }
+  unlink(path);
+  if (bind(sd, (struct sockaddr *) &uaddr, sizeof(uaddr)) == -1 || listen(sd, 16) == -1) {
+    close(sd);
+    return -1;
+  }
+  return sd;
+}
+
+static void on_signal(int sig) {
+  stopping = 1;
+}
+
+int main(int argc, char *argv[]) {
+  int ch, port = JBOD_PORT;
+  double target_hit_rate = 0;
+  bool use_unix = false, use_shm = false;
+
+  while ((ch = getopt(argc, argv, SERVER_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 's':
+        cache_size = atoi(optarg);
+        break;
+      case 'a':
+        target_hit_rate = atof(optarg) / 100;
+        break;
+      case 'q': {
+        int disk, min, max;
+        if (sscanf(optarg, "%d:%d:%d", &disk, &min, &max) != 3 ||
+            cache_set_partition(disk, disk) != 1 || cache_set_quota(disk, min, max) != 1)
+          errx(1, "Invalid cache quota %s", optarg);
+        break;
+      }
+      case 'u':
+        use_unix = true;
+        break;
+      case 'm':
+        use_shm = true;
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+
+  if (target_hit_rate > 0)
+    cache_set_target(target_hit_rate, cache_size);
+  if (cache_create(cache_size) != 1)
+    errx(1, "Invalid cache size %d", cache_size);
+
+  /* No SA_RESTART, so a signal breaks the server out of accept. */
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  int sd = socket(PF_INET, SOCK_STREAM, 0);
+  if (sd == -1)
+    err(1, "socket");
+  int one = 1;
+  setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in saddr;
+  memset(&saddr, 0, sizeof(saddr));
+  saddr.sin_family = AF_INET;
+  saddr.sin_port = htons(port);
+  saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(sd, (struct sockaddr *) &saddr, sizeof(saddr)) == -1)
+    err(1, "bind to port %d", port);
+  if (listen(sd, 16) == -1)
+    err(1, "listen");
+
+  struct pollfd fds[2] = { { .fd = sd, .events = POLLIN }, { .fd = -1, .events = POLLIN } };
+  if (use_unix && (fds[1].fd = listen_unix(JBOD_SOCKET_PATH)) == -1)
+    err(1, "listen on %s", JBOD_SOCKET_PATH);
+
+  jbod_shm_channel_t *shm = NULL;
+  pthread_t shm_tid;
+  if (use_shm) {
+    if ((shm = create_shm(JBOD_SHM_NAME)) == NULL)
+      err(1, "create %s", JBOD_SHM_NAME);
+    if (pthread_create(&shm_tid, NULL, shm_thread, shm) != 0)
+      err(1, "pthread_create");
+  }
+
+  while (!stopping) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      err(1, "poll");
+    }
+    int lsd = (fds[0].revents & POLLIN) ? fds[0].fd : fds[1].fd;
+    int csd = accept(lsd, NULL, NULL);
+    if (csd == -1) {
+      if (errno == EINTR)
+        continue;
+      err(1, "accept");
+    }
+    if (lsd == fds[0].fd) {
+      /* A push is a few bytes on its own; it must not sit waiting for the client's ack. */
+      setsockopt(csd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    server_client_t *c = calloc(1, sizeof(server_client_t));
+    c->sd = csd;
+    pthread_mutex_init(&c->send_mutex, NULL);
+    pthread_mutex_lock(&server_mutex);
+    add_client(c);
+    pthread_mutex_unlock(&server_mutex);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, client_thread, c) != 0)
+      err(1, "pthread_create");
+    pthread_detach(thread);
+  }
+
+  close(sd);
+  if (fds[1].fd != -1) {
+    close(fds[1].fd);
+    unlink(JBOD_SOCKET_PATH);
+  }
+  if (shm != NULL) {
+    pthread_join(shm_tid, NULL);
+    shm_unlink(JBOD_SHM_NAME);
+  }
+  pthread_mutex_lock(&server_mutex);
+  print_stats();
+  pthread_mutex_unlock(&server_mutex);
+  return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef CACHE_SERVER_H_
+#define CACHE_SERVER_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jbod.h"
+#include "net.h"
+
+/* Entries in the shared block cache unless -s says otherwise. */
+#define CACHE_SERVER_DEFAULT_ENTRIES 1024
+
+/* What the server keeps for each connected client. The JBOD has a single
+ * head, so every client gets a virtual one of its own; the real head is only
+ * moved when a block has to come from, or go to, the JBOD.
+ *
+ * may_cache marks the blocks the client has read or written, and so may hold
+ * in its own cache. When another client overwrites one of them it is queued
+ * in pending and pushed to the client before the writer gets its reply: down
+ * sd under send_mutex, which also keeps pushes out of the middle of a reply,
+ * or into the invalidation ring of shm. */
+typedef struct server_client {
+  int sd;
+  jbod_shm_channel_t *shm;
+  pthread_mutex_t send_mutex;
+  bool mounted;
+  bool writable;
+  int disk;
+  int block;
+  bool may_cache[JBOD_NUM_DISKS][JBOD_NUM_BLOCKS_PER_DISK];
+  uint16_t pending[JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK];
+  int num_pending;
+  struct server_client *next;
+} server_client_t;
+
+#endif
@@ -0,0 +1,220 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "iotrace.h"
+#include "jbod.h"
+
+/* One thread's records on their way to the capture file. The thread is the
+   only producer and the drain thread the only consumer, so head and tail are
+   all the synchronization there is; like the shared memory rings in net.h
+   they only ever grow and sit on separate cache lines. */
+typedef struct iotrace_ring {
+  _Atomic uint32_t head;
+  uint8_t pad1[60];
+  _Atomic uint32_t tail;
+  uint8_t pad2[60];
+  iotrace_record_t records[IOTRACE_RING_SIZE];
+  _Atomic uint64_t dropped;
+  _Atomic bool owned;
+  int thread;
+  struct iotrace_ring *next;
+} iotrace_ring_t;
+
+static _Atomic bool recording = false;
+static FILE *capture = NULL;
+static iotrace_header_t header;
+
+/* Rings are never freed, since a thread may be part way through a record when
+   recording stops. A thread that exits hands its ring back for the next new
+   thread, so replays that start threads over and over do not pile them up. */
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static iotrace_ring_t *rings = NULL;
+static int num_rings = 0;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread iotrace_ring_t *my_ring = NULL;
+
+static pthread_t drain_thread;
+static _Atomic bool draining = false;
+static int num_drains = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void ring_release(void *ring) {
+  atomic_store(&((iotrace_ring_t *) ring)->owned, false);
+}
+
+static void make_ring_key(void) {
+  pthread_key_create(&ring_key, ring_release);
+}
+
+/* Gives the calling thread a ring of its own, reusing one whose thread has exited. Returns NULL
+   if there is no memory for one. */
+static iotrace_ring_t *claim_ring(void) {
+  pthread_once(&ring_key_once, make_ring_key);
+  pthread_mutex_lock(&rings_mutex);
+  iotrace_ring_t *r;
+  for (r = rings; r != NULL; r = r->next) {
+    if (!atomic_load(&r->owned)) {
+      break;
+    }
+  }
+  if (r == NULL && (r = calloc(1, sizeof(iotrace_ring_t))) != NULL) {
+    r->thread = num_rings++;
+    r->next = rings;
+    rings = r;
+  }
+  if (r != NULL) {
+    atomic_store(&r->owned, true);
+  }
+  pthread_mutex_unlock(&rings_mutex);
+
+  if (r != NULL) {
+    pthread_setspecific(ring_key, r);
+  }
+  return r;
+}
+
+/* Moves everything the rings hold into the capture file, or drops it if |keep| is false. */
+static void drain_rings(bool keep) {
+  pthread_mutex_lock(&rings_mutex);
+  for (iotrace_ring_t *r = rings; r != NULL; r = r->next) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    /* At most two runs: up to the end of the array and from its start. */
+    while (keep && tail != head) {
+      uint32_t start = tail % IOTRACE_RING_SIZE;
+      uint32_t n = head - tail;
+      if (n > IOTRACE_RING_SIZE - start) {
+        n = IOTRACE_RING_SIZE - start;
+      }
+      fwrite(&r->records[start], sizeof(iotrace_record_t), n, capture);
+      header.num_records += n;
+      tail += n;
+    }
+    atomic_store_explicit(&r->tail, head, memory_order_release);
+  }
+  num_drains++;
+  pthread_mutex_unlock(&rings_mutex);
+}
+
+static void *drain_main(void *arg) {
+  while (atomic_load(&draining)) {
+    usleep(IOTRACE_DRAIN_INTERVAL_US);
+    drain_rings(true);
+  }
+  return NULL;
+}
+
+int iotrace_start(const char *path) {
+  if (capture != NULL) {
+    return -1;
+  }
+  capture = fopen(path, "w");
+  if (capture == NULL) {
+    return -1;
+  }
+
+  /* The header is rewritten with the real counts when recording stops. */
+  memset(&header, 0, sizeof(header));
+  header.magic = IOTRACE_MAGIC;
+  header.version = IOTRACE_VERSION;
+  fwrite(&header, sizeof(header), 1, capture);
+
+  /* Anything left over from an earlier recording belongs to that one. */
+  drain_rings(false);
+  pthread_mutex_lock(&rings_mutex);
+  for (iotrace_ring_t *r = rings; r != NULL; r = r->next) {
+    atomic_store(&r->dropped, 0);
+  }
+  pthread_mutex_unlock(&rings_mutex);
+
+  atomic_store(&draining, true);
+  if (pthread_create(&drain_thread, NULL, drain_main, NULL) != 0) {
+    atomic_store(&draining, false);
+    fclose(capture);
+    capture = NULL;
+    return -1;
+  }
+  atomic_store(&recording, true);
+  return 1;
+}
+
+void iotrace_stop(void) {
+  if (capture == NULL) {
+    return;
+  }
+  atomic_store(&recording, false);
+  atomic_store(&draining, false);
+  pthread_join(drain_thread, NULL);
+  drain_rings(true);
+
+  pthread_mutex_lock(&rings_mutex);
+  for (iotrace_ring_t *r = rings; r != NULL; r = r->next) {
+    header.num_dropped += atomic_load(&r->dropped);
+  }
+  pthread_mutex_unlock(&rings_mutex);
+
+  fseek(capture, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, capture);
+  fclose(capture);
+  capture = NULL;
+}
+
+uint64_t iotrace_begin(void) {
+  if (!atomic_load_explicit(&recording, memory_order_relaxed)) {
+    return 0;
+  }
+  return now_ns();
+}
+
+void iotrace_record(uint64_t start_ns, int cmd, uint32_t addr, uint32_t len, uint8_t ch,
+                    int misses, bool failed) {
+  if (start_ns == 0) {
+    return;
+  }
+  iotrace_ring_t *r = my_ring;
+  if (r == NULL && (r = my_ring = claim_ring()) == NULL) {
+    return;
+  }
+
+  uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == IOTRACE_RING_SIZE) {
+    atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  uint64_t latency = now_ns() - start_ns;
+  iotrace_record_t *rec = &r->records[head % IOTRACE_RING_SIZE];
+  rec->timestamp_ns = start_ns;
+  rec->latency_ns = latency > UINT32_MAX ? UINT32_MAX : latency;
+  rec->addr = addr;
+  rec->len = len;
+  rec->cmd = cmd;
+  rec->ch = ch;
+  rec->blocks = len == 0 ? 0 : (addr + len - 1) / JBOD_BLOCK_SIZE - addr / JBOD_BLOCK_SIZE + 1;
+  rec->misses = misses;
+  rec->failed = failed;
+  rec->thread = r->thread;
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+void iotrace_print_stats(void) {
+  if (header.magic != IOTRACE_MAGIC) {
+    return;
+  }
+  fprintf(stderr, "iotrace: records: %lu, dropped: %lu, threads: %d, drains: %d\n",
+          (unsigned long) header.num_records, (unsigned long) header.num_dropped, num_rings,
+          num_drains);
+}
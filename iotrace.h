@@ -0,0 +1,63 @@
+#ifndef IOTRACE_H_
+#define IOTRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define IOTRACE_MAGIC 0x4a42494f  /* "JBIO" */
+#define IOTRACE_VERSION 1
+
+/* Records each thread can have waiting for the drain thread. A thread that
+ * finds its ring full drops the record rather than wait. */
+#define IOTRACE_RING_SIZE 4096
+
+/* How long the drain thread sleeps between passes over the rings. */
+#define IOTRACE_DRAIN_INTERVAL_US 10000
+
+/* One recorded operation. cmd is a trace_cmd_t, so a capture converts to a
+ * workload trace op for op. For a WRITE, ch is the first byte written: the
+ * workload format can only replay writes of a single repeated byte. */
+typedef struct {
+  uint64_t timestamp_ns;  /* CLOCK_MONOTONIC when the call was made */
+  uint32_t latency_ns;
+  uint32_t addr;
+  uint16_t len;
+  uint8_t cmd;
+  uint8_t ch;
+  uint8_t blocks;         /* blocks the operation touched */
+  uint8_t misses;         /* of those, how many had to be read from the JBOD */
+  uint8_t failed;
+  uint8_t thread;         /* order in which the recording threads first recorded */
+} iotrace_record_t;
+
+/* A capture is this header followed by num_records records, in the order the
+ * drain thread collected them: each thread's records are in order, but the
+ * threads' are interleaved by drain pass, not by timestamp. */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t num_records;
+  uint64_t num_dropped;
+} iotrace_header_t;
+
+/* Returns 1 on success and -1 on failure. Creates the capture file at |path|
+ * and starts the drain thread; from now on iotrace_record keeps what it is
+ * given. */
+int iotrace_start(const char *path);
+
+/* Drains what is left, finishes the capture file and stops recording. */
+void iotrace_stop(void);
+
+/* Returns the time to pass to iotrace_record as |start_ns|, or 0 when nothing
+ * is being recorded, so that an idle recorder costs a single load. */
+uint64_t iotrace_begin(void);
+
+/* Records an operation that was started at |start_ns| (from iotrace_begin)
+ * and has just finished. Does nothing if |start_ns| is 0. Never blocks. */
+void iotrace_record(uint64_t start_ns, int cmd, uint32_t addr, uint32_t len, uint8_t ch,
+                    int misses, bool failed);
+
+/* Prints the recorder counters. */
+void iotrace_print_stats(void);
+
+#endif
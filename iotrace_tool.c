@@ -0,0 +1,275 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iotrace.h"
+#include "jbod.h"
+#include "trace.h"
+
+/* Turns a capture recorded with tester -i into something to replay or read:
+ *
+ *   usage: iotrace_tool text capture-file workload-file
+ *          iotrace_tool binary capture-file binary-trace-file
+ *          iotrace_tool summary capture-file
+ *
+ * text and binary write the calls, in the order they were made, as a workload
+ * for tester -w. summary prints latency percentiles and a heat map of the
+ * blocks the reads and writes touched.
+ */
+
+#define HEAT_COLUMNS 64
+#define HOT_BLOCKS 10
+
+static const char *heat_scale = " .:-=+*#%@";
+
+static int compare_records(const void *a, const void *b) {
+  const iotrace_record_t *x = a, *y = b;
+  if (x->timestamp_ns != y->timestamp_ns) {
+    return x->timestamp_ns < y->timestamp_ns ? -1 : 1;
+  }
+  return x->thread - y->thread;
+}
+
+/* Number of bits needed to hold x. */
+static int bits(uint32_t x) {
+  return x == 0 ? 0 : 32 - __builtin_clz(x);
+}
+
+/* Reads a whole capture into memory and puts its records in timestamp order. */
+static iotrace_record_t *load_capture(const char *path, iotrace_header_t *hdr) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot open capture file %s\n", path);
+    return NULL;
+  }
+  if (fread(hdr, sizeof(*hdr), 1, f) != 1 || hdr->magic != IOTRACE_MAGIC ||
+      hdr->version != IOTRACE_VERSION) {
+    fprintf(stderr, "%s is not a capture file\n", path);
+    fclose(f);
+    return NULL;
+  }
+  iotrace_record_t *recs = malloc((hdr->num_records + 1) * sizeof(iotrace_record_t));
+  if (fread(recs, sizeof(iotrace_record_t), hdr->num_records, f) != hdr->num_records) {
+    fprintf(stderr, "%s is cut short\n", path);
+    free(recs);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+
+  qsort(recs, hdr->num_records, sizeof(iotrace_record_t), compare_records);
+  return recs;
+}
+
+static void to_op(const iotrace_record_t *r, trace_op_t *op) {
+  memset(op, 0, sizeof(*op));
+  op->cmd = r->cmd;
+  if (r->cmd == TRACE_READ || r->cmd == TRACE_WRITE) {
+    op->addr = r->addr;
+    op->len = r->len;
+    op->ch = r->ch;
+  }
+}
+
+static int write_text(const iotrace_record_t *recs, uint64_t n, const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    return -1;
+  }
+  for (uint64_t i = 0; i < n; i++) {
+    trace_op_t op;
+    to_op(&recs[i], &op);
+    trace_print_op(f, &op);
+  }
+  return fclose(f) == 0 ? 1 : -1;
+}
+
+static int write_binary(const iotrace_record_t *recs, uint64_t n, const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    return -1;
+  }
+  trace_header_t hdr = { TRACE_MAGIC, TRACE_VERSION, n };
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  for (uint64_t i = 0; i < n; i++) {
+    trace_op_t op;
+    to_op(&recs[i], &op);
+    fwrite(&op, sizeof(op), 1, f);
+  }
+  return fclose(f) == 0 ? 1 : -1;
+}
+
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return (x > y) - (x < y);
+}
+
+/* Prints the latency percentiles of the records |pick| accepts. */
+static void print_latency(const char *name, const iotrace_record_t *recs, uint64_t n,
+                          bool (*pick)(const iotrace_record_t *)) {
+  uint32_t *lat = malloc((n + 1) * sizeof(uint32_t));
+  uint64_t count = 0;
+  double total = 0;
+  for (uint64_t i = 0; i < n; i++) {
+    if (pick(&recs[i])) {
+      lat[count++] = recs[i].latency_ns;
+      total += recs[i].latency_ns;
+    }
+  }
+  if (count > 0) {
+    qsort(lat, count, sizeof(uint32_t), compare_u32);
+    printf("%-11s %9lu  mean %9.0f  p50 %9u  p90 %9u  p99 %9u  max %9u ns\n", name,
+           (unsigned long) count, total / count, lat[count / 2], lat[count * 9 / 10],
+           lat[count * 99 / 100], lat[count - 1]);
+  }
+  free(lat);
+}
+
+static bool is_read_hit(const iotrace_record_t *r) {
+  return r->cmd == TRACE_READ && r->misses == 0;
+}
+
+static bool is_read_miss(const iotrace_record_t *r) {
+  return r->cmd == TRACE_READ && r->misses > 0;
+}
+
+static bool is_write(const iotrace_record_t *r) {
+  return r->cmd == TRACE_WRITE;
+}
+
+static bool is_other(const iotrace_record_t *r) {
+  return r->cmd != TRACE_READ && r->cmd != TRACE_WRITE;
+}
+
+static void summarize(const iotrace_record_t *recs, const iotrace_header_t *hdr) {
+  uint64_t n = hdr->num_records;
+  static uint32_t reads[JBOD_NUM_DISKS][JBOD_NUM_BLOCKS_PER_DISK];
+  static uint32_t writes[JBOD_NUM_DISKS][JBOD_NUM_BLOCKS_PER_DISK];
+  uint64_t blocks = 0, misses = 0, failed = 0;
+  int threads = 0;
+
+  for (uint64_t i = 0; i < n; i++) {
+    const iotrace_record_t *r = &recs[i];
+    failed += r->failed;
+    if (r->thread >= threads) {
+      threads = r->thread + 1;
+    }
+    if (r->cmd != TRACE_READ && r->cmd != TRACE_WRITE) {
+      continue;
+    }
+    if (r->cmd == TRACE_READ) {
+      blocks += r->blocks;
+      misses += r->misses;
+    }
+    for (uint32_t b = r->addr / JBOD_BLOCK_SIZE; b < r->addr / JBOD_BLOCK_SIZE + r->blocks; b++) {
+      if (b >= JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK) {
+        break;
+      }
+      if (r->cmd == TRACE_READ) {
+        reads[b / JBOD_NUM_BLOCKS_PER_DISK][b % JBOD_NUM_BLOCKS_PER_DISK]++;
+      } else {
+        writes[b / JBOD_NUM_BLOCKS_PER_DISK][b % JBOD_NUM_BLOCKS_PER_DISK]++;
+      }
+    }
+  }
+
+  double span_ms = n > 1 ? (recs[n - 1].timestamp_ns - recs[0].timestamp_ns) / 1e6 : 0;
+  printf("records: %lu, dropped: %lu, failed: %lu, threads: %d, span: %.3f ms\n",
+         (unsigned long) n, (unsigned long) hdr->num_dropped, (unsigned long) failed, threads,
+         span_ms);
+  if (blocks > 0) {
+    printf("read blocks: %lu, from the JBOD: %lu (%.1f%% miss)\n", (unsigned long) blocks,
+           (unsigned long) misses, 100.0 * misses / blocks);
+  }
+
+  printf("\nlatency\n");
+  print_latency("read hit", recs, n, is_read_hit);
+  print_latency("read miss", recs, n, is_read_miss);
+  print_latency("write", recs, n, is_write);
+  print_latency("other", recs, n, is_other);
+
+  /* One row per disk, each column covering an equal run of blocks, shaded by the log of how
+     often the busiest block in it was touched, on a scale that ends at the busiest block of all. */
+  uint32_t max = 0;
+  for (int d = 0; d < JBOD_NUM_DISKS; d++) {
+    for (int b = 0; b < JBOD_NUM_BLOCKS_PER_DISK; b++) {
+      if (reads[d][b] + writes[d][b] > max) {
+        max = reads[d][b] + writes[d][b];
+      }
+    }
+  }
+  if (max == 0) {
+    return;
+  }
+  int per_column = (JBOD_NUM_BLOCKS_PER_DISK + HEAT_COLUMNS - 1) / HEAT_COLUMNS;
+  int levels = strlen(heat_scale) - 1;
+  printf("\nheat map (%d blocks per column, '%c' = %u accesses)\n", per_column,
+         heat_scale[levels], max);
+  for (int d = 0; d < JBOD_NUM_DISKS; d++) {
+    printf("disk %2d |", d);
+    for (int c = 0; c * per_column < JBOD_NUM_BLOCKS_PER_DISK; c++) {
+      uint32_t hot = 0;
+      for (int b = c * per_column; b < (c + 1) * per_column && b < JBOD_NUM_BLOCKS_PER_DISK; b++) {
+        if (reads[d][b] + writes[d][b] > hot) {
+          hot = reads[d][b] + writes[d][b];
+        }
+      }
+      putchar(heat_scale[hot == 0 ? 0 : 1 + (levels - 1) * bits(hot) / bits(max)]);
+    }
+    printf("|\n");
+  }
+
+  printf("\nhottest blocks\n");
+  for (int k = 0; k < HOT_BLOCKS; k++) {
+    int best_d = -1, best_b = -1;
+    uint32_t best = 0;
+    for (int d = 0; d < JBOD_NUM_DISKS; d++) {
+      for (int b = 0; b < JBOD_NUM_BLOCKS_PER_DISK; b++) {
+        if (reads[d][b] + writes[d][b] > best) {
+          best = reads[d][b] + writes[d][b];
+          best_d = d;
+          best_b = b;
+        }
+      }
+    }
+    if (best_d == -1) {
+      break;
+    }
+    printf("disk %2d block %3d: %u reads, %u writes\n", best_d, best_b, reads[best_d][best_b],
+           writes[best_d][best_b]);
+    reads[best_d][best_b] = writes[best_d][best_b] = 0;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const char *cmd = argc > 2 ? argv[1] : "";
+  bool convert = strcmp(cmd, "text") == 0 || strcmp(cmd, "binary") == 0;
+  if (!(convert && argc == 4) && !(strcmp(cmd, "summary") == 0 && argc == 3)) {
+    fprintf(stderr, "usage: %s text capture-file workload-file\n"
+                    "       %s binary capture-file binary-trace-file\n"
+                    "       %s summary capture-file\n", argv[0], argv[0], argv[0]);
+    return 1;
+  }
+
+  iotrace_header_t hdr;
+  iotrace_record_t *recs = load_capture(argv[2], &hdr);
+  if (recs == NULL) {
+    return 1;
+  }
+
+  int rc = 1;
+  if (strcmp(cmd, "text") == 0) {
+    rc = write_text(recs, hdr.num_records, argv[3]);
+  } else if (strcmp(cmd, "binary") == 0) {
+    rc = write_binary(recs, hdr.num_records, argv[3]);
+  } else {
+    summarize(recs, &hdr);
+  }
+  if (rc != 1) {
+    fprintf(stderr, "Cannot write %s\n", argv[3]);
+  }
+  free(recs);
+  return rc == 1 ? 0 : 1;
+}
@@ -0,0 +1,246 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "jbod.h"
+#include "net.h"
+#include "util.h"
+
+#define JOURNAL_MAGIC 0x4a424a4c  /* "JBJL" */
+#define JOURNAL_MAX_BLOCKS 64
+
+/* A transaction is this header followed by num_blocks block records. The crc
+   covers the records, so a transaction cut short by a crash never checks out.
+   A header with no records is a checkpoint: every transaction before it has
+   been applied, and blocks written since may no longer match it. */
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t num_blocks;
+  uint32_t crc;
+} journal_header_t;
+
+typedef struct {
+  uint8_t disk_num;
+  uint8_t block_num;
+  uint8_t reserved[2];
+  uint8_t block[JBOD_BLOCK_SIZE];
+} journal_record_t;
+
+static int journal_fd = -1;
+static off_t journal_len = 0;
+static uint32_t next_seq = 0;
+static int unsynced_commits = 0;
+
+/* Whether a transaction has been committed since the last checkpoint. */
+static bool uncheckpointed = false;
+
+/* The transaction being built; written out in one go by journal_commit. */
+static uint8_t txn[sizeof(journal_header_t) + JOURNAL_MAX_BLOCKS * sizeof(journal_record_t)];
+static int txn_blocks = 0;
+
+static int num_commits = 0;
+static int num_blocks_logged = 0;
+static int num_syncs = 0;
+static int num_checkpoints = 0;
+
+/* Appends len bytes to the journal. On failure whatever part of them made it is
+   cut off again, so the next append follows the last complete record instead of
+   a torn one that replay would stop at. */
+static bool journal_append(const uint8_t *buf, size_t len) {
+  if (!nwrite(journal_fd, len, buf)) {
+    if (ftruncate(journal_fd, journal_len) == 0) {
+      lseek(journal_fd, journal_len, SEEK_SET);
+    }
+    return false;
+  }
+  journal_len += len;
+  return true;
+}
+
+/* Empties the journal. Only safe once every transaction in it has been applied. */
+static int journal_truncate(void) {
+  if (ftruncate(journal_fd, 0) == -1 || lseek(journal_fd, 0, SEEK_SET) == -1) {
+    return -1;
+  }
+  journal_len = 0;
+  uncheckpointed = false;
+  return 1;
+}
+
+int journal_open(const char *path) {
+  if (journal_fd != -1) {
+    return -1;
+  }
+  journal_fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (journal_fd == -1) {
+    return -1;
+  }
+  journal_len = lseek(journal_fd, 0, SEEK_END);
+  txn_blocks = 0;
+  unsynced_commits = 0;
+  uncheckpointed = journal_len > 0;
+  return 1;
+}
+
+void journal_close(void) {
+  if (journal_fd == -1) {
+    return;
+  }
+  fdatasync(journal_fd);
+  close(journal_fd);
+  journal_fd = -1;
+}
+
+bool journal_enabled(void) {
+  return journal_fd != -1;
+}
+
+int journal_add(int disk_num, int block_num, const uint8_t *buf) {
+  if (!journal_enabled() || txn_blocks == JOURNAL_MAX_BLOCKS) {
+    return -1;
+  }
+  journal_record_t *rec = (journal_record_t *) (txn + sizeof(journal_header_t)) + txn_blocks;
+  rec->disk_num = disk_num;
+  rec->block_num = block_num;
+  memset(rec->reserved, 0, sizeof(rec->reserved));
+  memcpy(rec->block, buf, JBOD_BLOCK_SIZE);
+  txn_blocks++;
+  return 1;
+}
+
+/* The caller applies each transaction right after committing it, so by the time the next one
+   is committed everything already in the journal is on the JBOD.  That is when the journal is
+   trimmed, and, once per group, when the fdatasync is paid. */
+int journal_commit(void) {
+  if (!journal_enabled()) {
+    return -1;
+  }
+  if (txn_blocks == 0) {
+    return 1;
+  }
+
+  if (journal_len >= JOURNAL_MAX_BYTES && journal_truncate() == -1) {
+    txn_blocks = 0;
+    return -1;
+  }
+
+  size_t rec_len = txn_blocks * sizeof(journal_record_t);
+  journal_header_t *hdr = (journal_header_t *) txn;
+  hdr->magic = JOURNAL_MAGIC;
+  hdr->seq = next_seq++;
+  hdr->num_blocks = txn_blocks;
+  hdr->crc = crc32c(txn + sizeof(journal_header_t), rec_len);
+
+  size_t len = sizeof(journal_header_t) + rec_len;
+  if (!journal_append(txn, len)) {
+    txn_blocks = 0;
+    return -1;
+  }
+  uncheckpointed = true;
+  num_blocks_logged += txn_blocks;
+  num_commits++;
+  txn_blocks = 0;
+
+  if (++unsynced_commits >= JOURNAL_GROUP_COMMIT) {
+    fdatasync(journal_fd);
+    num_syncs++;
+    unsynced_commits = 0;
+  }
+  return 1;
+}
+
+int journal_sync(void) {
+  if (!journal_enabled()) {
+    return -1;
+  }
+  fdatasync(journal_fd);
+  num_syncs++;
+  unsynced_commits = 0;
+  return journal_truncate();
+}
+
+int journal_checkpoint(void) {
+  if (!journal_enabled()) {
+    return -1;
+  }
+  if (!uncheckpointed) {
+    return 1;
+  }
+  journal_header_t hdr = { JOURNAL_MAGIC, next_seq++, 0, 0 };
+  if (!journal_append((const uint8_t *) &hdr, sizeof(hdr))) {
+    return -1;
+  }
+  uncheckpointed = false;
+  num_checkpoints++;
+  return 1;
+}
+
+/* Reads the record at the journal's file offset into hdr and, for a
+   transaction, its blocks into recs. Returns false at the end of the journal
+   or at a torn record. */
+static bool read_record(journal_header_t *hdr, uint8_t *recs) {
+  if (!nread(journal_fd, sizeof(*hdr), (uint8_t *) hdr) ||
+      hdr->magic != JOURNAL_MAGIC || hdr->num_blocks > JOURNAL_MAX_BLOCKS) {
+    return false;
+  }
+  size_t rec_len = hdr->num_blocks * sizeof(journal_record_t);
+  return nread(journal_fd, rec_len, recs) && crc32c(recs, rec_len) == hdr->crc;
+}
+
+/* Only the transactions after the last checkpoint are redone: the ones before
+   it were applied, and redoing them could undo blocks written since. */
+int journal_replay(int (*apply)(int disk_num, int block_num, const uint8_t *buf)) {
+  if (!journal_enabled() || lseek(journal_fd, 0, SEEK_SET) == -1) {
+    return -1;
+  }
+
+  journal_header_t hdr;
+  uint8_t *recs = txn + sizeof(journal_header_t);
+  off_t from = 0, pos = 0;
+  while (read_record(&hdr, recs)) {
+    pos += sizeof(hdr) + hdr.num_blocks * sizeof(journal_record_t);
+    if (hdr.num_blocks == 0) {
+      from = pos;
+    }
+    next_seq = hdr.seq + 1;
+  }
+  if (lseek(journal_fd, from, SEEK_SET) == -1) {
+    return -1;
+  }
+
+  int replayed = 0;
+  while (read_record(&hdr, recs)) {
+    for (uint32_t i = 0; i < hdr.num_blocks; i++) {
+      journal_record_t *rec = (journal_record_t *) recs + i;
+      if (apply(rec->disk_num, rec->block_num, rec->block) == -1) {
+        /* Keep the journal, so the next mount tries again. */
+        lseek(journal_fd, journal_len, SEEK_SET);
+        debug_log("journal: replay failed at disk %d block %d", rec->disk_num, rec->block_num);
+        return -1;
+      }
+    }
+    if (hdr.num_blocks > 0) {
+      replayed++;
+    }
+  }
+  debug_log("journal: replayed %d transactions", replayed);
+
+  if (journal_sync() == -1) {
+    return -1;
+  }
+  return replayed;
+}
+
+void journal_print_stats(void) {
+  if (num_commits == 0) {
+    return;
+  }
+  fprintf(stderr, "journal: commits: %d, blocks_logged: %d, checkpoints: %d, syncs: %d\n",
+          num_commits, num_blocks_logged, num_checkpoints, num_syncs);
+}
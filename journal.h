@@ -0,0 +1,58 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jbod.h"
+
+/* Number of committed transactions between two fdatasync calls on the journal. */
+#define JOURNAL_GROUP_COMMIT 32
+
+/* Size after which the journal is truncated once everything in it has been applied. */
+#define JOURNAL_MAX_BYTES (1 << 20)
+
+/* Returns 1 on success and -1 on failure. Opens (creating if needed) the
+ * journal file at |path|. Anything already in it is left for journal_replay. */
+int journal_open(const char *path);
+
+/* Syncs and closes the journal. */
+void journal_close(void);
+
+/* Returns true if a journal is open and false if not. */
+bool journal_enabled(void);
+
+/* Returns 1 on success and -1 on failure. Adds the new contents of
+ * |disk_num|/|block_num| to the transaction being built. */
+int journal_add(int disk_num, int block_num, const uint8_t *buf);
+
+/* Returns 1 on success and -1 on failure. Appends the blocks added since the
+ * last commit to the journal as one transaction, in a single write. Once this
+ * returns the transaction survives a crash of the process; it is synced to
+ * disk with the rest of its group every JOURNAL_GROUP_COMMIT commits, or by
+ * journal_sync. On failure the transaction is dropped; the caller adds its
+ * blocks again to retry. */
+int journal_commit(void);
+
+/* Returns 1 on success and -1 on failure. Syncs the journal and, since every
+ * committed transaction has been applied by the time this is called, empties
+ * it. */
+int journal_sync(void);
+
+/* Returns 1 on success and -1 on failure. Records that every committed
+ * transaction has been applied, so replay does not redo them. Called before a
+ * block is written without the journal; does nothing if no transaction has
+ * been committed since the last checkpoint. */
+int journal_checkpoint(void);
+
+/* Calls |apply| for every block of every complete transaction after the last
+ * checkpoint, in order, then empties the journal. A torn transaction at the
+ * tail was never applied and is dropped. Returns the number of transactions
+ * replayed, or -1 on failure, including when |apply| returns -1; the journal
+ * is then kept for the next replay. */
+int journal_replay(int (*apply)(int disk_num, int block_num, const uint8_t *buf));
+
+/* Prints the journal counters. */
+void journal_print_stats(void);
+
+#endif
@@ -1,19 +1,209 @@
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "block.h"
 #include "cache.h"
 #include "jbod.h"
 #include "mdadm.h"
 #include "net.h"
+#include "util.h"
+#include "journal.h"
+#include "iotrace.h"
+#include "trace.h"
+
+/* Address translation is done with shifts and masks derived from jbod.h, so a JBOD of another
+   geometry only needs jbod.h changed; the asserts reject a geometry this arithmetic cannot handle. */
+#define BLOCK_SHIFT __builtin_ctz(JBOD_BLOCK_SIZE)
+#define BLOCK_MASK (JBOD_BLOCK_SIZE - 1)
+#define DISK_SHIFT __builtin_ctz(JBOD_DISK_SIZE)
+#define DISK_MASK (JBOD_DISK_SIZE - 1)
+#define ARRAY_SIZE ((uint32_t) JBOD_NUM_DISKS * JBOD_DISK_SIZE)
+
+_Static_assert((JBOD_BLOCK_SIZE & BLOCK_MASK) == 0, "JBOD_BLOCK_SIZE must be a power of two");
+_Static_assert((JBOD_DISK_SIZE & DISK_MASK) == 0, "JBOD_DISK_SIZE must be a power of two");
+_Static_assert(JBOD_DISK_SIZE == JBOD_BLOCK_SIZE * JBOD_NUM_BLOCKS_PER_DISK,
+	"a disk must hold a whole number of blocks");
+_Static_assert(JBOD_NUM_DISKS <= 16 && JBOD_NUM_BLOCKS_PER_DISK <= 256,
+	"disk and block numbers must fit their opcode fields");
+
+/* The part of a transfer that falls in a single block. */
+typedef struct {
+	int disk;
+	int block;
+	uint32_t offset;
+	uint32_t len;
+} span_t;
 
 int is_mounted = 0;
 int is_written = 0;
 int write_permission = 0;
 
+/* block_crc holds the CRC32C of every block whose contents mdadm knows, either because it wrote
+   the block or because it read it back from the JBOD.  Reads that go to the JBOD are checked
+   against it, which catches corruption without a JBOD_SIGN_BLOCK round trip. */
+static uint32_t block_crc[JBOD_NUM_DISKS][JBOD_NUM_BLOCKS_PER_DISK];
+static bool block_crc_valid[JBOD_NUM_DISKS][JBOD_NUM_BLOCKS_PER_DISK];
+
+/* block_fill records, for blocks mdadm knows to hold a single repeated byte, which byte that is
+   (and -1 for everything else).  Reads of such blocks are answered locally instead of fetching
+   256 bytes that are all the same from the JBOD. */
+static int16_t block_fill[JBOD_NUM_DISKS][JBOD_NUM_BLOCKS_PER_DISK];
+static int num_elided_reads = 0;
+
+/* Copy-on-write snapshot state.  snap_map redirects a block of the snapshot to the copy of its old
+   contents taken on the first write after the snapshot; blocks still NULL there have not changed
+   and are read from the array as usual.  The JBOD has no spare blocks outside the 1 MiB address
+   space, so the copies are kept in memory.  The snapshot lasts until the array is unmounted, since
+   mounting again wipes the JBOD.  It is broken if another client of the server overwrites a block
+   before it was copied: that block's old contents are gone, so snapshot reads fail from then on. */
+static bool snap_active = false;
+static bool snap_broken = false;
+static bool snap_reading = false;
+static uint8_t *snap_map[JBOD_NUM_DISKS][JBOD_NUM_BLOCKS_PER_DISK];
+static int snap_blocks_written = 0;
+static int snap_blocks_copied = 0;
+static int snap_extra_reads = 0;
+
+/* Write-combining buffer.  mdadm_write only merges its bytes into the pending image of each block
+   it touches; dirty marks which bytes of the image were written.  wc_flush writes every pending
+   block out in one batch, reading a block first only if it was not completely overwritten, so
+   any number of small writes to the same block cost at most one read and one write per batch.
+   The buffer is flushed when the next write would not fit in wc_limit blocks (so a single
+   mdadm_write never straddles two batches), before any read that overlaps a pending block, and
+   on unmount, revoking write permission, snapshots and mdadm_flush.  A buffered write is reported
+   as done before it reaches the JBOD, so buffering is off (wc_limit 0) until
+   mdadm_set_write_batch turns it on, and with a journal open or on the server every write is
+   flushed before it returns, the buffer then only making each write one batch. */
+#define WC_MAX_BLOCKS 16
+typedef struct {
+	int disk;
+	int block;
+	uint8_t data[JBOD_BLOCK_SIZE];
+	uint8_t dirty[JBOD_BLOCK_SIZE];
+} wc_block_t;
+
+static wc_block_t wc[WC_MAX_BLOCKS];
+static int wc_count = 0;
+static int wc_limit = 0;
+static int num_writes = 0;
+static int num_merged_writes = 0;
+static int num_flushes = 0;
+static int num_blocks_flushed = 0;
+static int num_rmw_reads = 0;
+static int num_skipped_writes = 0;
+static int num_fill_writes = 0;
+static int num_invalidations = 0;
+
+/* Blocks the read or write in progress has had to fetch from the JBOD, for the I/O trace. */
+static int op_misses = 0;
+
+/* Read-ahead across disk boundaries.  When a run of back-to-back reads gets within
+   PREFETCH_BLOCKS blocks of the end of a disk, the reads of the rest of that disk, the seek to
+   the next one and the reads of its first PREFETCH_BLOCKS blocks are sent to the server as one
+   pipelined sweep, without waiting for the replies.  They travel and are carried out while the
+   caller gets on with its own work, and each is taken only when a read needs its block or
+   something else needs the connection, so the seek no longer costs a round trip in the middle
+   of the stream.  With the in-process JBOD there is nothing to overlap and no sweep is made.
+   pf is kept apart from the cache: freshly inserted entries are the first the cache evicts, so
+   a sweep stored there would mostly evict itself.  An entry is ready once its reply is in;
+   pf_replies lists the replies still to come, in order, as the key of the block each read is
+   for, or -1 for a seek. */
+#define PREFETCH_BLOCKS 4
+typedef struct {
+	int disk;
+	int block;
+	bool ready;
+	uint8_t data[JBOD_BLOCK_SIZE];
+} pf_block_t;
+
+static pf_block_t pf[2 * PREFETCH_BLOCKS];
+static int pf_count = 0;
+static int pf_replies[JBOD_MAX_PIPELINE];
+static int pf_num_replies = 0;
+static int pf_next_reply = 0;
+static bool pf_failed = false;
+static bool read_ahead = true;
+static uint32_t stream_next_addr = UINT32_MAX;
+static int num_prefetches = 0;
+static int num_prefetched_blocks = 0;
+static int num_prefetch_hits = 0;
+
+/* Where mdadm last left the JBOD's head, so a seek is only issued when the head is somewhere
+   else; -1 when it is not known. */
+static int head_disk = -1;
+static int head_block = -1;
+
+static bool use_server = false;
+/* Whether the server takes JBOD_FILL_BLOCK; cleared the first time it fails one that a plain
+   WRITE_BLOCK then succeeds at. */
+static bool server_fills = true;
+
+/* All of the state above, the cache and the JBOD's head position are shared, so every public
+   entry point runs under mdadm_mutex.  The counters record how often callers had to wait, and
+   how long the lock was held, split into the time spent in JBOD operations (the in-process JBOD
+   or the network) and the rest (mdadm itself and the cache).  There is only the one lock, so
+   the wait cannot be put down to either part on its own. */
+static pthread_mutex_t mdadm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long lock_acquisitions = 0;
+static long lock_contended = 0;
+static double lock_wait_ms = 0;
+static double lock_held_ms = 0;
+static double lock_jbod_ms = 0;
+static struct timespec lock_taken;
+
+static int read_locked(uint32_t start_addr, uint32_t read_len, uint8_t *read_buf);
+static int write_locked(uint32_t start_addr, uint32_t write_len, const uint8_t *write_buf);
+static wc_block_t *wc_find(int disk, int block);
+static void prefetch_wait(void);
+static void snapshot_drop(void);
+
+/* Sends a JBOD operation to the in-process JBOD, or to the server tester connected to once
+   mdadm_use_server has been called. */
+static int jbod_issue(uint32_t op, uint8_t *block) {
+	prefetch_wait();
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	int r = use_server ? jbod_client_operation(op,block) : jbod_operation(op,block);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	lock_jbod_ms += (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+	return r;
+}
+
+/* Takes mdadm_mutex, timing the wait if another thread holds it. */
+static void mdadm_lock(void) {
+	if (pthread_mutex_trylock(&mdadm_mutex) != 0) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC,&start);
+		pthread_mutex_lock(&mdadm_mutex);
+		clock_gettime(CLOCK_MONOTONIC,&end);
+		lock_contended++;
+		lock_wait_ms += (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+	}
+	lock_acquisitions++;
+	clock_gettime(CLOCK_MONOTONIC,&lock_taken);
+}
+
+static void mdadm_unlock(void) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	lock_held_ms += (end.tv_sec - lock_taken.tv_sec) * 1e3 + (end.tv_nsec - lock_taken.tv_nsec) / 1e6;
+	pthread_mutex_unlock(&mdadm_mutex);
+}
+
+/* Applies the invalidations the server has pushed since the last call, so that what is cached
+   can be trusted for the rest of it. */
+static void catch_up(void) {
+	if (use_server) {
+		jbod_poll_invalidations();
+	}
+}
+
 /* the create_opcode function is used to simplify the task of creating the opcode and reducing
    redundant code.*/
 uint32_t create_opcode(uint32_t DiskID, uint32_t BlockID, uint32_t Command, uint32_t Reserved) {
@@ -25,12 +215,523 @@ uint32_t create_opcode(uint32_t DiskID, uint32_t BlockID, uint32_t Command, uint
 	return opcode;
 }
 
+/* Records in block_fill whether buf, the current contents of a block, is a single repeated byte. */
+static void note_fill(int disk, int block, const uint8_t *buf) {
+	block_fill[disk][block] = block_uniform(buf) ? buf[0] : -1;
+}
+
+/* Splits [*addr, end_addr) at block boundaries: fills sp with the piece that starts at *addr and
+   moves *addr past it.  Returns false once the whole range has been walked. */
+static bool span_next(uint32_t *addr, uint32_t end_addr, span_t *sp) {
+	if (*addr >= end_addr) {
+		return false;
+	}
+	sp->disk = *addr >> DISK_SHIFT;
+	sp->block = (*addr & DISK_MASK) >> BLOCK_SHIFT;
+	sp->offset = *addr & BLOCK_MASK;
+	sp->len = JBOD_BLOCK_SIZE - sp->offset;
+	if (sp->len > end_addr - *addr) {
+		sp->len = end_addr - *addr;
+	}
+	*addr += sp->len;
+	return true;
+}
+
+/* Moves the head onto a block, skipping whichever seeks are not needed.  Returns 1 on success
+   and -1 on failure, after which the head position is unknown. */
+static int seek_to(int disk, int block) {
+	if (disk != head_disk) {
+		if (jbod_issue(create_opcode(disk,0,JBOD_SEEK_TO_DISK,0),NULL) == -1) {
+			head_disk = -1;
+			head_block = -1;
+			return -1;
+		}
+		head_disk = disk;
+		head_block = -1;
+	}
+	if (block != head_block) {
+		if (jbod_issue(create_opcode(0,block,JBOD_SEEK_TO_BLOCK,0),NULL) == -1) {
+			head_block = -1;
+			return -1;
+		}
+		head_block = block;
+	}
+	return 1;
+}
+
+/* Reading or writing a block leaves the head on the next one.  Past the last block of a disk
+   it is left unknown rather than guessing what the JBOD does there. */
+static void head_advance(void) {
+	head_block++;
+	if (head_block == JBOD_NUM_BLOCKS_PER_DISK) {
+		head_disk = -1;
+		head_block = -1;
+	}
+}
+
+/* Reads a block from the JBOD itself.  The contents are checked against block_crc (or recorded
+   there if unknown); returns 1 on success and -1 on a failed read or a checksum mismatch. */
+static int fetch_block(int disk, int block, uint8_t *buf) {
+	if (seek_to(disk,block) == -1) {
+		return -1;
+	}
+	if (jbod_issue(create_opcode(0,0,JBOD_READ_BLOCK,0),buf) == -1) {
+		head_block = -1;
+		return -1;
+	}
+	head_advance();
+	note_fill(disk,block,buf);
+
+	uint32_t crc = crc32c(buf,JBOD_BLOCK_SIZE);
+	if (block_crc_valid[disk][block] && block_crc[disk][block] != crc) {
+		return -1;
+	}
+	block_crc[disk][block] = crc;
+	block_crc_valid[disk][block] = true;
+	return 1;
+}
+
+/* Returns the index of a block's entry in pf, or -1 if it has none. */
+static int prefetch_find(int disk, int block) {
+	for (int i = 0; i < pf_count; i++) {
+		if (pf[i].disk == disk && pf[i].block == block) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Takes the next reply of the sweep in flight.  A block is checked against block_crc like one
+   read by fetch_block.  Its entry is dropped instead if it does not match, if it was dropped
+   while in flight, or if anything earlier in the sweep failed, since a read after a failed seek
+   is of the wrong block. */
+static void prefetch_take_reply(void) {
+	int key = pf_replies[pf_next_reply++];
+	uint8_t buf[JBOD_BLOCK_SIZE];
+	if (jbod_client_recv(buf) == -1) {
+		pf_failed = true;
+		head_disk = -1;
+		head_block = -1;
+	}
+	int i = key == -1 ? -1 : prefetch_find(key >> 8,key & 0xff);
+	if (i != -1) {
+		int disk = pf[i].disk, block = pf[i].block;
+		uint32_t crc = crc32c(buf,JBOD_BLOCK_SIZE);
+		if (pf_failed || (block_crc_valid[disk][block] && block_crc[disk][block] != crc)) {
+			pf[i] = pf[--pf_count];
+		}
+		else {
+			block_copy(pf[i].data,buf);
+			pf[i].ready = true;
+			block_crc[disk][block] = crc;
+			block_crc_valid[disk][block] = true;
+			note_fill(disk,block,buf);
+			num_prefetched_blocks++;
+		}
+	}
+	if (pf_next_reply == pf_num_replies) {
+		pf_num_replies = 0;
+		pf_next_reply = 0;
+		pf_failed = false;
+	}
+}
+
+/* Takes every reply still to come, so the connection can be used for something else. */
+static void prefetch_wait(void) {
+	while (pf_num_replies > 0) {
+		prefetch_take_reply();
+	}
+}
+
+/* Reads a block into buf, going to the JBOD only if the snapshot, the cache or block_fill cannot
+   answer.  Returns 1 on success and -1 on a failed read or a checksum mismatch. */
+static int read_block(int disk, int block, uint8_t *buf) {
+	if (snap_reading && snap_map[disk][block] != NULL) {
+		block_copy(buf,snap_map[disk][block]);
+		return 1;
+	}
+	if (cache_lookup(disk,block,buf) == 1) {
+		return 1;
+	}
+	int i = prefetch_find(disk,block);
+	while (i != -1 && !pf[i].ready) {
+		prefetch_take_reply();
+		i = prefetch_find(disk,block);
+	}
+	if (i != -1) {
+		block_copy(buf,pf[i].data);
+		num_prefetch_hits++;
+		return 1;
+	}
+	if (block_fill[disk][block] != -1) {
+		memset(buf,block_fill[disk][block],JBOD_BLOCK_SIZE);
+		num_elided_reads++;
+		return 1;
+	}
+	op_misses++;
+	return fetch_block(disk,block,buf);
+}
+
+/* Called after a read that ended just before addr.  If the reads form a sequential run that is
+   about to cross into the next disk, sends the sweep for every block from addr up to
+   PREFETCH_BLOCKS blocks into the next disk that the cache, block_fill and pf do not already
+   cover.  Nothing is sent while the last sweep is still on its way, since it covers the same
+   blocks. */
+static void prefetch_ahead(uint32_t addr, bool sequential) {
+	int disk = addr >> DISK_SHIFT;
+	int block = (addr & DISK_MASK) >> BLOCK_SHIFT;
+	if (!use_server || !read_ahead || !sequential || pf_num_replies > 0 || disk + 1 >= JBOD_NUM_DISKS ||
+	    block < JBOD_NUM_BLOCKS_PER_DISK - PREFETCH_BLOCKS) {
+		return;
+	}
+
+	/* Keep only what falls inside the new window; the rest has been read past. */
+	uint32_t first = addr >> BLOCK_SHIFT;
+	uint32_t last = ((uint32_t) (disk + 1) << (DISK_SHIFT - BLOCK_SHIFT)) + PREFETCH_BLOCKS - 1;
+	for (int i = 0; i < pf_count; ) {
+		uint32_t b = ((uint32_t) pf[i].disk << (DISK_SHIFT - BLOCK_SHIFT)) | pf[i].block;
+		if (b < first || b > last) {
+			pf[i] = pf[--pf_count];
+		}
+		else {
+			i++;
+		}
+	}
+
+	bool sent = false, ok = true;
+	/* A block can take two seeks and a read, and the pipeline only has room for so many. */
+	for (uint32_t b = first; b <= last && pf_num_replies + 3 <= JBOD_MAX_PIPELINE; b++) {
+		int d = b >> (DISK_SHIFT - BLOCK_SHIFT);
+		int k = b & (JBOD_NUM_BLOCKS_PER_DISK - 1);
+		if (block_fill[d][k] != -1 || wc_find(d,k) != NULL || cache_contains(d,k) ||
+		    prefetch_find(d,k) != -1) {
+			continue;
+		}
+		if (d != head_disk) {
+			if (jbod_client_send(create_opcode(d,0,JBOD_SEEK_TO_DISK,0),NULL) == -1) {
+				ok = false;
+				break;
+			}
+			pf_replies[pf_num_replies++] = -1;
+			head_disk = d;
+			head_block = -1;
+		}
+		if (k != head_block) {
+			if (jbod_client_send(create_opcode(0,k,JBOD_SEEK_TO_BLOCK,0),NULL) == -1) {
+				ok = false;
+				break;
+			}
+			pf_replies[pf_num_replies++] = -1;
+			head_block = k;
+		}
+		if (jbod_client_send(create_opcode(0,0,JBOD_READ_BLOCK,0),NULL) == -1) {
+			ok = false;
+			break;
+		}
+		pf_replies[pf_num_replies++] = d << 8 | k;
+		head_advance();
+		pf_block_t *p = &pf[pf_count++];
+		p->disk = d;
+		p->block = k;
+		p->ready = false;
+		sent = true;
+	}
+	/* Whether a request that could not be sent got anywhere is not known. */
+	if (!ok) {
+		head_disk = -1;
+		head_block = -1;
+	}
+	num_prefetches += sent;
+}
+
+/* Forgets any prefetched copy of a block that is about to be overwritten. */
+static void prefetch_drop(int disk, int block) {
+	for (int i = 0; i < pf_count; i++) {
+		if (pf[i].disk == disk && pf[i].block == block) {
+			pf[i] = pf[--pf_count];
+			return;
+		}
+	}
+}
+
+/* Saves the current contents of a block for the active snapshot before its first overwrite.  old
+   is what the caller already read from the block, or NULL if it has to be read here.  Returns 1
+   on success and -1 if the old contents could not be read or stored, in which case the block must
+   not be overwritten. */
+static int snapshot_preserve(int disk, int block, const uint8_t *old) {
+	uint8_t temp[JBOD_BLOCK_SIZE];
+	if (old == NULL) {
+		if (read_block(disk,block,temp) == -1) {
+			return -1;
+		}
+		snap_extra_reads++;
+		old = temp;
+	}
+	uint8_t *copy = malloc(JBOD_BLOCK_SIZE);
+	if (copy == NULL) {
+		return -1;
+	}
+	block_copy(copy,old);
+	snap_map[disk][block] = copy;
+	snap_blocks_copied++;
+	return 1;
+}
+
+/* Writes buf to the block under the head.  On the server a uniform block is sent as a
+   JBOD_FILL_BLOCK, so only its fill byte crosses the wire. Returns 0 or -1 like jbod_operation. */
+static int write_block_here(const uint8_t *buf) {
+	if (use_server && server_fills && block_uniform(buf)) {
+		if (jbod_issue(create_opcode(0,buf[0],JBOD_FILL_BLOCK,0),NULL) == 0) {
+			num_fill_writes++;
+			return 0;
+		}
+		if (jbod_issue(create_opcode(0,0,JBOD_WRITE_BLOCK,0),(uint8_t *) buf) == -1) {
+			return -1;
+		}
+		server_fills = false;
+		return 0;
+	}
+	return jbod_issue(create_opcode(0,0,JBOD_WRITE_BLOCK,0),(uint8_t *) buf);
+}
+
+/* Writes buf to a block, keeping the cache and block_crc in step with it.  old is the block's
+   previous contents if the caller has them, and NULL otherwise.  Nothing is written if the block
+   is known to hold buf already: from old or the cache when the contents are at hand, otherwise
+   from block_fill or block_crc.  The cached copy only stands in for old while block_crc_valid
+   says mdadm has read or written the block since mount and nobody has overwritten it since; a
+   copy carried over from before is not trusted to skip a write.  Returns 1 on success and -1 on
+   failure, in which case the cache, block_crc and block_fill are left as they were. */
+static int apply_block(int disk, int block, const uint8_t *buf, const uint8_t *old) {
+	uint8_t temp_buffer[JBOD_BLOCK_SIZE];
+	bool cached = cache_lookup(disk,block,temp_buffer) == 1;
+	if (old == NULL && cached && block_crc_valid[disk][block]) {
+		old = temp_buffer;
+	}
+
+	uint32_t crc = crc32c(buf,JBOD_BLOCK_SIZE);
+	bool unchanged;
+	if (old != NULL) {
+		unchanged = block_equal(buf,old);
+	}
+	else if (block_fill[disk][block] != -1) {
+		unchanged = block_uniform(buf) && buf[0] == block_fill[disk][block];
+	}
+	else {
+		unchanged = block_crc_valid[disk][block] && block_crc[disk][block] == crc;
+	}
+	if (unchanged) {
+		num_skipped_writes++;
+		return 1;
+	}
+
+	if (snap_active && snap_map[disk][block] == NULL && snapshot_preserve(disk,block,old) == -1) {
+		return -1;
+	}
+	if (seek_to(disk,block) == -1) {
+		return -1;
+	}
+	if (write_block_here(buf) == -1) {
+		head_block = -1;
+		return -1;
+	}
+	head_advance();
+	if (snap_active) {
+		snap_blocks_written++;
+	}
+	prefetch_drop(disk,block);
+	if (cached) {
+		cache_update(disk,block,buf);
+	}
+	else {
+		cache_insert(disk,block,buf);
+	}
+	block_crc[disk][block] = crc;
+	block_crc_valid[disk][block] = true;
+	note_fill(disk,block,buf);
+	return 1;
+}
+
+/* Finds the pending image of a block in the write-combining buffer, or returns NULL. */
+static wc_block_t *wc_find(int disk, int block) {
+	for (int i = 0; i < wc_count; i++) {
+		if (wc[i].disk == disk && wc[i].block == block) {
+			return &wc[i];
+		}
+	}
+	return NULL;
+}
+
+/* Orders pending blocks by address so a flush sweeps the array once. */
+static int wc_compare(const void *a, const void *b) {
+	const wc_block_t *x = a, *y = b;
+	return (x->disk * JBOD_NUM_BLOCKS_PER_DISK + x->block) - (y->disk * JBOD_NUM_BLOCKS_PER_DISK + y->block);
+}
+
+/* Writes every pending block out as one batch.  Blocks that were only partly overwritten are
+   completed from their current contents first; with a journal open, the whole batch is committed
+   as one transaction before the first JBOD write.  Returns 1 on success and -1 on failure.  On
+   failure the blocks that were not written stay pending, so a later flush can retry them. */
+static int wc_flush(void) {
+	if (wc_count == 0) {
+		return 1;
+	}
+	qsort(wc,wc_count,sizeof(wc_block_t),wc_compare);
+
+	uint8_t old[WC_MAX_BLOCKS][JBOD_BLOCK_SIZE];
+	bool has_old[WC_MAX_BLOCKS];
+	for (int i = 0; i < wc_count; i++) {
+		has_old[i] = memchr(wc[i].dirty,0,JBOD_BLOCK_SIZE) != NULL;
+		if (!has_old[i]) {
+			continue;
+		}
+		if (read_block(wc[i].disk,wc[i].block,old[i]) == -1) {
+			return -1;
+		}
+		num_rmw_reads++;
+		block_merge(wc[i].data,old[i],wc[i].dirty);
+	}
+
+	/* A batch of one block is atomic without the journal, but replay must not redo an earlier
+	   transaction over it. */
+	if (journal_enabled() && wc_count > 1) {
+		for (int i = 0; i < wc_count; i++) {
+			journal_add(wc[i].disk,wc[i].block,wc[i].data);
+		}
+		if (journal_commit() == -1) {
+			return -1;
+		}
+	}
+	else if (journal_enabled() && journal_checkpoint() == -1) {
+		return -1;
+	}
+
+	for (int i = 0; i < wc_count; i++) {
+		if (apply_block(wc[i].disk,wc[i].block,wc[i].data,has_old[i] ? old[i] : NULL) == -1) {
+			/* Keep the blocks from this one on; the ones before it are on the JBOD. */
+			num_blocks_flushed += i;
+			memmove(wc,wc+i,(wc_count - i) * sizeof(wc_block_t));
+			wc_count -= i;
+			return -1;
+		}
+	}
+	num_blocks_flushed += wc_count;
+	num_flushes++;
+	wc_count = 0;
+	return 1;
+}
+
+/* Returns true if every mdadm_write is flushed before it returns: with buffering off, with a
+   journal open (see the write-combining buffer above), or on the server, where other clients
+   must see a write, and have their copies invalidated, once it is reported as done. */
+static bool write_through(void) {
+	return wc_limit == 0 || journal_enabled() || use_server;
+}
+
+/* Flushes the write-combining buffer if any pending block lies in [start_addr, end_addr]. */
+static int wc_flush_range(uint32_t start_addr, uint32_t end_addr) {
+	uint32_t first = start_addr >> BLOCK_SHIFT;
+	uint32_t last = end_addr >> BLOCK_SHIFT;
+	for (int i = 0; i < wc_count; i++) {
+		uint32_t b = ((uint32_t) wc[i].disk << (DISK_SHIFT - BLOCK_SHIFT)) | wc[i].block;
+		if (b >= first && b <= last) {
+			return wc_flush();
+		}
+	}
+	return 1;
+}
+
+/* Redoes one block from the journal during recovery.  The cache is updated rather than filled,
+   since it may still hold the block's contents from before the crash.  Returns 1 on success and
+   -1 on failure. */
+static int replay_block(int disk, int block, const uint8_t *buf) {
+	if (seek_to(disk,block) == -1) {
+		return -1;
+	}
+	if (jbod_issue(create_opcode(0,0,JBOD_WRITE_BLOCK,0),(uint8_t *) buf) == -1) {
+		head_block = -1;
+		return -1;
+	}
+	head_advance();
+	cache_update(disk,block,buf);
+	note_fill(disk,block,buf);
+	return 1;
+}
+
+/* Asks the server for the array's generation (see JBOD_GET_GENERATION).  Returns 0, which never
+   matches, without a server or from one that does not keep generations. */
+static uint64_t array_generation(void) {
+	uint8_t buf[JBOD_BLOCK_SIZE];
+	if (!use_server || jbod_issue(create_opcode(0,0,JBOD_GET_GENERATION,0),buf) == -1) {
+		return 0;
+	}
+	uint64_t generation = 0;
+	for (int i = 0; i < 8; i++) {
+		generation = generation << 8 | buf[i];
+	}
+	return generation;
+}
+
+/* Tells the server which blocks the cache still holds from an earlier session, so that writes to
+   them by other clients are pushed to us like writes to blocks we read this session. */
+static void hold_cached_blocks(void) {
+	uint16_t keys[CACHE_MAX_ENTRIES];
+	int n = cache_blocks(keys);
+	if (!use_server || n == 0) {
+		return;
+	}
+	for (int first = 0; first < JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK; first += JBOD_HOLD_BLOCKS_PER_OP) {
+		uint8_t bitmap[JBOD_BLOCK_SIZE];
+		memset(bitmap,0,sizeof(bitmap));
+		for (int i = 0; i < n; i++) {
+			int b = (keys[i] >> 8) * JBOD_NUM_BLOCKS_PER_DISK + (keys[i] & 0xff) - first;
+			if (b >= 0 && b < JBOD_HOLD_BLOCKS_PER_OP) {
+				bitmap[b / 8] |= 1 << b % 8;
+			}
+		}
+		jbod_issue(create_opcode(first / JBOD_NUM_BLOCKS_PER_DISK,0,JBOD_HOLD_BLOCKS,0),bitmap);
+	}
+}
+
 /* This function mounts the disk by calling the jbod_operation function.  is_mounted is alos updated
    to reflect the changes. */
-int mdadm_mount(void) {
-	int result = jbod_operation(create_opcode(0,0,JBOD_MOUNT,0), NULL);
+static int mount_locked(void) {
+	int result = jbod_issue(create_opcode(0,0,JBOD_MOUNT,0), NULL);
+	head_disk = -1;
+	head_block = -1;
 	if (result == 0) {
+		/* Someone else may have written to the array since we last saw it. */
+		memset(block_crc_valid, 0, sizeof(block_crc_valid));
+		memset(block_fill, 0xff, sizeof(block_fill));
+		pf_count = 0;
+		stream_next_addr = UINT32_MAX;
 		is_mounted = 1;
+		/* Only left over if the array was unmounted behind our back; its blocks are gone. */
+		if (snap_active) {
+			snapshot_drop();
+		}
+
+		/* Whatever the cache still holds, from a snapshot or an earlier mount, is only kept if
+		   nobody has written to the array since it was last unmounted.  The blocks are held first,
+		   so a write that slips in between shows up either in the generation or as a push. */
+		if (cache_enabled()) {
+			hold_cached_blocks();
+			cache_check_generation(array_generation());
+		}
+
+		/* Finish any multi-block write that a crash cut short.  Without write permission the
+		   replay fails and the journal is kept; the array is not left mounted half-recovered. */
+		if (journal_enabled()) {
+			int granted = jbod_issue(create_opcode(0,0,JBOD_WRITE_PERMISSION,0),NULL) == 0;
+			int r = journal_replay(replay_block);
+			if (granted) {
+				jbod_issue(create_opcode(0,0,JBOD_REVOKE_WRITE_PERMISSION,0),NULL);
+			}
+			if (r == -1) {
+				jbod_issue(create_opcode(0,0,JBOD_UNMOUNT,0),NULL);
+				is_mounted = 0;
+				return -1;
+			}
+		}
 		return 1;
 	}
 	else return -1;
@@ -38,35 +739,289 @@ int mdadm_mount(void) {
 
 /* This function unmounts the disk by calling the jbod_operation function.  is_mounted is also updated
    to reflect the changes. */
-int mdadm_unmount(void) {
-	int result = jbod_operation(create_opcode(0,0,JBOD_UNMOUNT,0), NULL);
+static int unmount_locked(void) {
+	/* Writes mdadm_write has already reported as done must not be lost on the way out. */
+	if (wc_flush() == -1) {
+		return -1;
+	}
+	if (journal_enabled()) {
+		journal_sync();
+	}
+	/* Invalidations for writes up to the generation arrive with it or just before it. */
+	if (cache_enabled()) {
+		uint64_t generation = array_generation();
+		catch_up();
+		cache_set_generation(generation);
+	}
+	int result = jbod_issue(create_opcode(0,0,JBOD_UNMOUNT,0), NULL);
 	if (result == 0) {
 		is_mounted = 0;
+		if (snap_active) {
+			snapshot_drop();
+		}
 		return 1;
 	}
 	else return -1;
 }
 
+/* This function looks up the checksum mdadm has on record for a block, so callers can compare
+   whole-array checksum tables without issuing any JBOD operations. */
+int mdadm_block_checksum(int disk_num, int block_num, uint32_t *crc) {
+	if (disk_num < 0 || disk_num >= JBOD_NUM_DISKS || block_num < 0 || block_num >= JBOD_NUM_BLOCKS_PER_DISK) {
+		return -1;
+	}
+	if (crc == NULL || !block_crc_valid[disk_num][block_num]) {
+		return -1;
+	}
+	*crc = block_crc[disk_num][block_num];
+	return 1;
+}
+
+/* This function walks the checksum table.  Only blocks with a checksum on record are looked at, so
+   on an array that has hardly been touched there is next to nothing to do, and blocks the cache
+   holds cost a CRC each rather than a JBOD round trip.  Deep checks go through the JBOD in address
+   order so the head sweeps the array once. */
+int mdadm_verify(bool deep) {
+	mdadm_lock();
+	if (is_mounted == 0) {
+		mdadm_unlock();
+		return -1;
+	}
+	int checked = 0, from_cache = 0, mismatches = 0;
+	uint8_t buf[JBOD_BLOCK_SIZE];
+	for (int disk = 0; disk < JBOD_NUM_DISKS; disk++) {
+		for (int block = 0; block < JBOD_NUM_BLOCKS_PER_DISK; block++) {
+			if (!block_crc_valid[disk][block]) {
+				continue;
+			}
+			if (cache_peek(disk,block,buf) == 1) {
+				from_cache++;
+			}
+			else if (deep) {
+				seek_to(disk,block);
+				if (jbod_issue(create_opcode(0,0,JBOD_READ_BLOCK,0),buf) == -1) {
+					head_disk = -1;
+					fprintf(stderr, "verify: disk %d block %d: read failed\n", disk, block);
+					mismatches++;
+					continue;
+				}
+				head_advance();
+			}
+			else {
+				continue;
+			}
+			checked++;
+			if (crc32c(buf,JBOD_BLOCK_SIZE) != block_crc[disk][block]) {
+				fprintf(stderr, "verify: disk %d block %d: checksum mismatch\n", disk, block);
+				mismatches++;
+			}
+		}
+	}
+	fprintf(stderr, "verify: checked: %d (%d from the cache), mismatches: %d\n",
+		checked, from_cache, mismatches);
+	mdadm_unlock();
+	return mismatches;
+}
+
+/* This function takes a copy-on-write snapshot of the whole array.  Nothing is copied here; each
+   block is copied on its first write afterwards, so this is O(1). Only one snapshot can exist. */
+int mdadm_snapshot_create(void) {
+	uint64_t start = iotrace_begin();
+	mdadm_lock();
+	if (is_mounted == 0 || snap_active) {
+		mdadm_unlock();
+		iotrace_record(start,TRACE_SNAPSHOT,0,0,0,0,true);
+		return -1;
+	}
+	if (wc_flush() == -1) {
+		mdadm_unlock();
+		iotrace_record(start,TRACE_SNAPSHOT,0,0,0,0,true);
+		return -1;
+	}
+	/* The server only reports writes to blocks it thinks we hold, and the snapshot depends on
+	   every block it has not preserved yet. */
+	if (use_server) {
+		uint8_t bitmap[JBOD_BLOCK_SIZE];
+		memset(bitmap,0xff,sizeof(bitmap));
+		for (int first = 0; first < JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK; first += JBOD_HOLD_BLOCKS_PER_OP) {
+			if (jbod_issue(create_opcode(first / JBOD_NUM_BLOCKS_PER_DISK,0,JBOD_HOLD_BLOCKS,0),bitmap) == -1) {
+				mdadm_unlock();
+				iotrace_record(start,TRACE_SNAPSHOT,0,0,0,0,true);
+				return -1;
+			}
+		}
+	}
+	snap_active = true;
+	mdadm_unlock();
+	iotrace_record(start,TRACE_SNAPSHOT,0,0,0,0,false);
+	return 1;
+}
+
+/* Frees the blocks the snapshot preserved and ends it. */
+static void snapshot_drop(void) {
+	for (int i = 0; i < JBOD_NUM_DISKS; i++) {
+		for (int j = 0; j < JBOD_NUM_BLOCKS_PER_DISK; j++) {
+			free(snap_map[i][j]);
+			snap_map[i][j] = NULL;
+		}
+	}
+	snap_active = false;
+	snap_broken = false;
+}
+
+/* This function drops the snapshot and frees the blocks it preserved. */
+int mdadm_snapshot_delete(void) {
+	mdadm_lock();
+	if (!snap_active) {
+		mdadm_unlock();
+		return -1;
+	}
+	snapshot_drop();
+	mdadm_unlock();
+	return 1;
+}
+
+/* This function reads from the snapshot through the normal read path; read_block redirects any
+   block that was overwritten since the snapshot to its preserved copy. */
+int mdadm_snapshot_read(uint32_t addr, uint32_t len, uint8_t *buf) {
+	mdadm_lock();
+	if (!snap_active || snap_broken) {
+		mdadm_unlock();
+		return -1;
+	}
+	if (wc_flush_range(addr,addr+len-1) == -1) {
+		mdadm_unlock();
+		return -1;
+	}
+	snap_reading = true;
+	int r = read_locked(addr,len,buf);
+	snap_reading = false;
+	mdadm_unlock();
+	return r;
+}
+
+/* This function prints how much extra work the snapshot has cost the write path. */
+void mdadm_print_snapshot_stats(void) {
+	if (snap_blocks_written == 0 && !snap_active) {
+		return;
+	}
+	fprintf(stderr, "snapshot: blocks_written: %d, blocks_copied: %d, extra_reads: %d\n",
+		snap_blocks_written, snap_blocks_copied, snap_extra_reads);
+	if (snap_blocks_written > 0) {
+		fprintf(stderr, "Write amplification: %.2f\n",
+			(float) (snap_blocks_written + snap_blocks_copied) / snap_blocks_written);
+	}
+}
+
+/* This function prints how much JBOD traffic mdadm avoided. */
+void mdadm_print_io_stats(void) {
+	fprintf(stderr, "elided_reads: %d\n", num_elided_reads);
+	fprintf(stderr, "writes: %d, merged: %d, flushes: %d, blocks_flushed: %d, rmw_reads: %d\n",
+		num_writes, num_merged_writes, num_flushes, num_blocks_flushed, num_rmw_reads);
+	fprintf(stderr, "skipped_writes: %d, bytes_saved: %ld\n",
+		num_skipped_writes, (long) num_skipped_writes * JBOD_BLOCK_SIZE);
+	fprintf(stderr, "prefetches: %d, prefetched_blocks: %d, prefetch_hits: %d\n",
+		num_prefetches, num_prefetched_blocks, num_prefetch_hits);
+	if (use_server) {
+		fprintf(stderr, "invalidations: %d, fill_writes: %d\n", num_invalidations, num_fill_writes);
+	}
+}
+
+/* This function sets how many blocks the write-combining buffer may hold before it is flushed.
+   With 0, every mdadm_write is flushed before it returns. */
+int mdadm_set_write_batch(int blocks) {
+	if (blocks < 0 || blocks > WC_MAX_BLOCKS) {
+		return -1;
+	}
+	mdadm_lock();
+	int r = wc_flush();
+	if (r == 1) {
+		wc_limit = blocks;
+	}
+	mdadm_unlock();
+	return r;
+}
+
+/* This function turns read-ahead across disk boundaries on or off. */
+void mdadm_set_read_ahead(bool enable) {
+	mdadm_lock();
+	prefetch_wait();
+	pf_count = 0;
+	read_ahead = enable;
+	mdadm_unlock();
+}
+
+/* Forgets everything mdadm knows about a block that another client of the server has overwritten:
+   its cached copy, checksum, fill byte and any prefetched copy, and breaks the snapshot if the
+   block's old contents were not preserved.  Called from inside
+   jbod_poll_invalidations or jbod_client_operation, so mdadm_mutex is already held. */
+static void invalidate_block(int disk, int block) {
+	if (snap_active && snap_map[disk][block] == NULL) {
+		snap_broken = true;
+	}
+	cache_invalidate(disk,block);
+	block_crc_valid[disk][block] = false;
+	block_fill[disk][block] = -1;
+	prefetch_drop(disk,block);
+	num_invalidations++;
+}
+
+/* This function switches between the in-process JBOD and the server.  It is only allowed while
+   the array is unmounted, since the two hold different contents. */
+int mdadm_use_server(bool enable) {
+	if (is_mounted) {
+		return -1;
+	}
+	use_server = enable;
+	server_fills = true;
+	jbod_set_invalidation_handler(enable ? invalidate_block : NULL);
+	return 1;
+}
+
+/* This function writes out everything held in the write-combining buffer.  Callers flush before
+   using the JBOD themselves, so the head is assumed to move before mdadm sees it again. */
+int mdadm_flush(void) {
+	mdadm_lock();
+	int r = wc_flush();
+	prefetch_wait();
+	head_disk = -1;
+	head_block = -1;
+	pf_count = 0;
+	mdadm_unlock();
+	return r;
+}
+
 /* This function enables write permissions by invoking the JBOD function. */
 int mdadm_write_permission(void) {
-	int r = jbod_operation(create_opcode(0,0,JBOD_WRITE_PERMISSION,0),NULL);
+	uint64_t start = iotrace_begin();
+	mdadm_lock();
+	int r = jbod_issue(create_opcode(0,0,JBOD_WRITE_PERMISSION,0),NULL);
 	if (r == 0) {
 		write_permission = 1;
 	}
+	mdadm_unlock();
 	//printf("Write permissions is %d and write_permission is now %d\n",r,write_permission);
+	iotrace_record(start,TRACE_WRITE_PERMIT,0,0,0,0,r == -1);
 	return r;
 }
 
 /* This function revokes write permissions by invoking the JBOD function. */
 int mdadm_revoke_write_permission(void) {
-	int r = jbod_operation(create_opcode(0,0,JBOD_REVOKE_WRITE_PERMISSION,0),NULL);
+	uint64_t start = iotrace_begin();
+	mdadm_lock();
+	int r = -1;
+	if (wc_flush() == 1) {
+		r = jbod_issue(create_opcode(0,0,JBOD_REVOKE_WRITE_PERMISSION,0),NULL);
+	}
 	if (r == 0) {
 		write_permission = 0;
 	}
+	mdadm_unlock();
+	iotrace_record(start,TRACE_WRITE_PERMIT_REVOKE,0,0,0,0,r == -1);
 	return r;
 }
 
-int mdadm_read(uint32_t start_addr, uint32_t read_len, uint8_t *read_buf)  {
+static int read_locked(uint32_t start_addr, uint32_t read_len, uint8_t *read_buf)  {
 
 	/* The below 5 if statements checks that the inputted parameters are met and that the disk
 	   is mounted. */
@@ -78,11 +1033,11 @@ int mdadm_read(uint32_t start_addr, uint32_t read_len, uint8_t *read_buf)  {
 		return 0;
 	}
 
-	if (start_addr < 0 || start_addr + read_len - 1 >= 16*JBOD_DISK_SIZE) {
+	if (start_addr < 0 || start_addr + read_len - 1 >= ARRAY_SIZE) {
 		return -1;
 	}
 
-	if (read_len > 1024) {
+	if (read_len > MDADM_MAX_IO_SIZE) {
 		return -1;
 	}
 
@@ -90,124 +1045,41 @@ int mdadm_read(uint32_t start_addr, uint32_t read_len, uint8_t *read_buf)  {
 		return -1;
 	}
 
-	// Determining start and end disks and blocks for use later in the program.
-	uint32_t start_disk = start_addr / JBOD_DISK_SIZE;
-	uint32_t end_disk = (start_addr + read_len - 1) / JBOD_DISK_SIZE;
-	uint32_t start_block = start_addr % JBOD_DISK_SIZE / JBOD_BLOCK_SIZE;
-	uint32_t end_block = ((start_addr + read_len - 1) % JBOD_DISK_SIZE) / JBOD_BLOCK_SIZE;
-
-	// Initial Seek to Disk
-	jbod_operation(create_opcode(start_disk,0,JBOD_SEEK_TO_DISK,0),NULL);
-
-	// Initial Seek to Block
-	jbod_operation(create_opcode(0,start_block,JBOD_SEEK_TO_BLOCK,0),NULL);
-
-	/* the c_block and c_disk variables are initialized in order to keep track of the current
-	   block and disk.  The c_pointer is used to keep track of the current position within the
-	   read buffer.  The read variable tracks the number of bytes read until now. */
-	int c_block = start_block;
-	int c_disk = start_disk;
-	uint8_t* c_pointer = read_buf;
-	int read = 0;
-
-	/* This loop keeps repeating until the number of bytes read equals the length of what we want
-	   to read. */
-	while (read < read_len) {
-
-		/* This block executes when reading within a singular block. */
-		if (start_disk == end_disk && start_block == end_block) {
-			int start_pos = start_addr % JBOD_BLOCK_SIZE;
-			int end_pos = (start_addr + read_len - 1) % JBOD_BLOCK_SIZE;
-			int len = ((JBOD_BLOCK_SIZE-start_pos+1)-(JBOD_BLOCK_SIZE-end_pos-1) - 1);
-			uint8_t temp[JBOD_BLOCK_SIZE];
-			if (cache_lookup(start_disk,start_block,temp) == 1) {
-				jbod_operation(create_opcode(0,start_block+1,JBOD_SEEK_TO_BLOCK,0),NULL);
-			}
-			else {
-			jbod_operation(create_opcode(0,0,JBOD_READ_BLOCK,0),temp);
-			}
-			int j = 0;
-			for (int i = start_pos; i <= end_pos; i++) {
-				c_pointer[j] = temp[i];
-				j++;
-			}
-			c_pointer += len;
-			read += len;
-		}
-		
-		/* This block executes on the first iteration of a multi-block read, accounting for
-		   the edge case where the first byte lies within a block. */
-		else if (start_disk == c_disk && start_block == c_block) {	
-			int start_pos = start_addr % JBOD_BLOCK_SIZE;
-			int len = JBOD_BLOCK_SIZE-start_pos;
-			uint8_t temp[JBOD_BLOCK_SIZE];
-			if (cache_lookup(c_disk,c_block,temp) == 1) {
-				jbod_operation(create_opcode(0,c_block+1,JBOD_SEEK_TO_BLOCK,0),NULL);
-			}
-			else {
-				jbod_operation(create_opcode(0,0,JBOD_READ_BLOCK,0),temp);
-			}
-			int j = 0;
-			for (int i = start_pos; i < JBOD_BLOCK_SIZE; i++) {
-				c_pointer[j] = temp[i];
-				j++;
-			}
-			c_pointer += (len);
-			read += len;
-		}
+	if (wc_flush_range(start_addr,start_addr+read_len-1) == -1) {
+		return -1;
+	}
 
-		/* This block executes on the last iteration of a multi-block read, accounting for
-		   the edge case where the last byte lies within a block. */
-		else if (end_disk == c_disk && end_block == c_block) {
-			int end_pos = (start_addr + read_len - 1) % JBOD_BLOCK_SIZE;
-			uint8_t temp[JBOD_BLOCK_SIZE];
-			if (cache_lookup(c_disk,c_block,temp) == 1) {
-				jbod_operation(create_opcode(0,c_block+1,JBOD_SEEK_TO_BLOCK,0),NULL);
-			}
-			else {
-				jbod_operation(create_opcode(0,0,JBOD_READ_BLOCK,0),temp);
+	/* Every piece of the read is one block or part of one; whole blocks go straight into
+	   read_buf and partial ones through a bounce buffer. */
+	uint32_t addr = start_addr;
+	uint8_t *c_pointer = read_buf;
+	span_t sp;
+	while (span_next(&addr,start_addr+read_len,&sp)) {
+		if (sp.len == JBOD_BLOCK_SIZE) {
+			if (read_block(sp.disk,sp.block,c_pointer) == -1) {
+				return -1;
 			}
-			for (int i = 0; i <= end_pos; i++) {
-				c_pointer[i] = temp[i];
-			}
-			c_pointer += (end_pos + 1);
-			read += (end_pos + 1);
 		}
-
-		/* This block executes when the entire block needs to be read.  It accounts for the
-		   majority of block reads. */
 		else {
 			uint8_t temp[JBOD_BLOCK_SIZE];
-			if (cache_lookup(c_disk,c_block,temp) == 1) {
-				jbod_operation(create_opcode(0,c_block+1,JBOD_SEEK_TO_BLOCK,0),NULL);
+			if (read_block(sp.disk,sp.block,temp) == -1) {
+				return -1;
 			}
-			else {
-				jbod_operation(create_opcode(0,0,JBOD_READ_BLOCK,0),temp);
-			}
-			for (int i = 0; i < JBOD_BLOCK_SIZE; i++) {
-				c_pointer[i] = temp[i];
-			}
-			c_pointer += JBOD_BLOCK_SIZE;
-			read += JBOD_BLOCK_SIZE;
-
-		}
-
-		/* The if statement below iterates the current block and disk based on the value of
-		   the current block.  This allows multi-block and multi-disk reads to occur. */
-		c_block++;
-		if (c_block > 255) {
-			c_block = 0;
-			c_disk += 1;
-			jbod_operation(create_opcode(c_disk,0,JBOD_SEEK_TO_DISK,0),NULL);
+			memcpy(c_pointer,temp+sp.offset,sp.len);
 		}
+		c_pointer += sp.len;
 	}
+
+	bool sequential = start_addr == stream_next_addr;
+	stream_next_addr = start_addr + read_len;
+	prefetch_ahead(stream_next_addr,sequential);
 	return read_len;
 }
 
 
 /* This loop keeps repeating until the number of bytes written equals the length of what we want
    to write. */
-int mdadm_write(uint32_t start_addr, uint32_t write_len, const uint8_t *write_buf) {
+static int write_locked(uint32_t start_addr, uint32_t write_len, const uint8_t *write_buf) {
 
 	/* The below 5 if statements checks that the inputted parameters are met and that the disk
 	   is mounted. */
@@ -227,11 +1099,11 @@ int mdadm_write(uint32_t start_addr, uint32_t write_len, const uint8_t *write_bu
 		return 0;
 	}
 
-	if (start_addr < 0 || start_addr + write_len - 1 >= 16*JBOD_DISK_SIZE) {
+	if (start_addr < 0 || start_addr + write_len - 1 >= ARRAY_SIZE) {
 		return -1;
 	}
 
-	if (write_len > 1024) {
+	if (write_len > MDADM_MAX_IO_SIZE) {
 		return -1;
 	}
 
@@ -239,155 +1111,106 @@ int mdadm_write(uint32_t start_addr, uint32_t write_len, const uint8_t *write_bu
 		return -1;
 	}
 
-	// Determining start and end disks and blocks for use later in the program.
-	uint32_t start_disk = start_addr / ((uint32_t) JBOD_DISK_SIZE);
-	uint32_t end_disk = (start_addr + write_len - 1) / ((uint32_t) JBOD_DISK_SIZE);
-	uint32_t start_block = start_addr % JBOD_DISK_SIZE / JBOD_BLOCK_SIZE;
-	uint32_t end_block = ((start_addr + write_len - 1) % JBOD_DISK_SIZE) / JBOD_BLOCK_SIZE;
-
-	// Initial Seek to Disk
-	jbod_operation(create_opcode(start_disk,0,JBOD_SEEK_TO_DISK,0),NULL);
-
-	// Initial Seek to Block
-	jbod_operation(create_opcode(0,start_block,JBOD_SEEK_TO_BLOCK,0),NULL);
-
-	/* the c_block and c_disk variables are initialized in order to keep track of the current
-	block and disk.  The c_pointer is used to keep track of the current position within the
-	read buffer.  The write variable tracks the number of bytes write until now. */
-	int c_block = start_block;
-	int c_disk = start_disk;
-	uint8_t* c_pointer = (uint8_t*) write_buf;
-	int write = 0;
-	uint8_t temp_buffer[256];
-
-	while (write < write_len) {
-		/* This block executes when writing within a singular block. */
-		if (start_disk == end_disk && start_block == end_block) {
-			int start_pos = start_addr % JBOD_BLOCK_SIZE;
-			int end_pos = (start_addr + write_len - 1) % JBOD_BLOCK_SIZE;
-			int len = ((JBOD_BLOCK_SIZE-start_pos+1)-(JBOD_BLOCK_SIZE-end_pos-1) - 1);
-			uint8_t read_temp[JBOD_BLOCK_SIZE];
-			uint8_t write_temp[JBOD_BLOCK_SIZE];
-			if (cache_lookup(c_disk,c_block,read_temp) == 1) {
-				jbod_operation(create_opcode(0,c_block+1,JBOD_SEEK_TO_BLOCK,0),NULL);
-			}
-			else {
-				jbod_operation(create_opcode(0,0,JBOD_READ_BLOCK,0),read_temp);
-			}
-			for (int i = 0; i < start_pos; i++) {
-				write_temp[i] = read_temp[i];
-			}
-			for (int i = end_pos + 1; i < JBOD_BLOCK_SIZE; i++) {
-				write_temp[i] = read_temp[i];
-			}
-			int j = 0;
-			for (int i = start_pos; i <= end_pos; i++) {
-				write_temp[i] = c_pointer[j];
-				j++;
-			}
-			jbod_operation(create_opcode(0,c_block,JBOD_SEEK_TO_BLOCK,0),NULL);
-			if (cache_lookup(c_disk,c_block,temp_buffer) == 1) {
-				cache_update(c_disk,c_block,write_temp);
-			}
-			else {
-				cache_insert(c_disk,c_block,write_temp);
-			}
-			jbod_operation(create_opcode(0,0,JBOD_WRITE_BLOCK,0),write_temp);
-			c_pointer += len;
-			write += len;
-		}
-
-		/* This block executes on the first iteration of a multi-block write, accounting for
-		   the edge case where the first byte lies within a block. */
-		else if (start_disk == c_disk && start_block == c_block) {	
-			int start_pos = start_addr % JBOD_BLOCK_SIZE;
-			int len = JBOD_BLOCK_SIZE-start_pos;
-			uint8_t read_temp[JBOD_BLOCK_SIZE];
-			uint8_t write_temp[JBOD_BLOCK_SIZE];
-			if (cache_lookup(c_disk,c_block,read_temp) == 1) {
-				jbod_operation(create_opcode(0,c_block+1,JBOD_SEEK_TO_BLOCK,0),NULL);
-			}
-			else {
-				jbod_operation(create_opcode(0,0,JBOD_READ_BLOCK,0),read_temp);
-			}
-			for (int i = 0; i < start_pos; i++) {
-				write_temp[i] = read_temp[i];
-			}
-			jbod_operation(create_opcode(0,c_block,JBOD_SEEK_TO_BLOCK,0),NULL);
-			int j = 0;
-			for (int i = start_pos; i < JBOD_BLOCK_SIZE; i++) {
-				write_temp[i] = c_pointer[j];
-				j++;
-			}
-			if (cache_lookup(c_disk,c_block,temp_buffer) == 1) {
-				cache_update(c_disk,c_block,write_temp);
-			}
-			else {
-				cache_insert(c_disk,c_block,write_temp);
-			}
-			jbod_operation(create_opcode(0,0,JBOD_WRITE_BLOCK,0),write_temp);
-			c_pointer += (len);
-			write += len;
-		}
-
-		/* This block executes on the last iteration of a multi-block write, accounting for
-		   the edge case where the last byte lies within a block. */
-		else if (end_disk == c_disk && end_block == c_block) {
-			int end_pos = (start_addr + write_len - 1) % JBOD_BLOCK_SIZE;
-			uint8_t write_temp[JBOD_BLOCK_SIZE];
-			uint8_t read_temp[JBOD_BLOCK_SIZE];
-			if (cache_lookup(c_disk,c_block,read_temp) == 1) {
-				jbod_operation(create_opcode(0,c_block+1,JBOD_SEEK_TO_BLOCK,0),NULL);
-			}
-			else {
-				jbod_operation(create_opcode(0,0,JBOD_READ_BLOCK,0),read_temp);
-			}
-			for (int i = 0; i <= end_pos; i++) {
-				write_temp[i] = c_pointer[i];
-			}
-			jbod_operation(create_opcode(0,end_block,JBOD_SEEK_TO_BLOCK,0),NULL);
-			for (int i = end_pos + 1; i < JBOD_BLOCK_SIZE; i++) {
-				write_temp[i] = read_temp[i];
-			}
-			if (cache_lookup(c_disk,c_block,temp_buffer) == 1) {
-				cache_update(c_disk,c_block,write_temp);
-			}
-			else {
-				cache_insert(c_disk,c_block,write_temp);
-			}
-			jbod_operation(create_opcode(0,0,JBOD_WRITE_BLOCK,0),write_temp);
-			c_pointer += (end_pos + 1);
-			write += (end_pos + 1);
+	uint32_t end_addr = start_addr + write_len;
+	uint32_t addr = start_addr;
+	span_t sp;
+
+	/* Make room first if the blocks this write adds would not fit in the current batch. */
+	int missing = 0;
+	while (span_next(&addr,end_addr,&sp)) {
+		missing += wc_find(sp.disk,sp.block) == NULL;
+	}
+	if (wc_count + missing > wc_limit && wc_flush() == -1) {
+		return -1;
+	}
+
+	/* Merge each piece of the write into the pending image of its block. */
+	addr = start_addr;
+	const uint8_t *c_pointer = write_buf;
+	while (span_next(&addr,end_addr,&sp)) {
+		wc_block_t *w = wc_find(sp.disk,sp.block);
+		if (w == NULL) {
+			w = &wc[wc_count++];
+			w->disk = sp.disk;
+			w->block = sp.block;
+			memset(w->dirty,0,JBOD_BLOCK_SIZE);
 		}
-		
-		/* This block executes when the entire block needs to be written.  It accounts for the
-		   majority of block writes. */
 		else {
-			uint8_t temp[JBOD_BLOCK_SIZE];
-			for (int i = 0; i < JBOD_BLOCK_SIZE; i++) {
-				temp[i] = c_pointer[i];
-			}
-			if (cache_lookup(c_disk,c_block,temp_buffer) == 1) {
-				cache_update(c_disk,c_block,temp);
-			}
-			else {
-				cache_insert(c_disk,c_block,temp);
-			}
-			jbod_operation(create_opcode(0,0,JBOD_WRITE_BLOCK,0),temp);
-			c_pointer += JBOD_BLOCK_SIZE;
-			write += JBOD_BLOCK_SIZE;
-
+			num_merged_writes++;
 		}
+		memcpy(w->data + sp.offset,c_pointer,sp.len);
+		memset(w->dirty + sp.offset,1,sp.len);
+		c_pointer += sp.len;
+	}
+	num_writes++;
 
-		/* The if statement below iterates the current block and disk based on the value of
-		   the current block.  This allows multi-block and multi-disk writes to occur. */
-		c_block++;
-		if (c_block > JBOD_BLOCK_SIZE - 1) {
-			c_block = 0;
-			c_disk += 1;
-			jbod_operation(create_opcode(c_disk,0,JBOD_SEEK_TO_DISK,0),NULL);
+	if (write_through()) {
+		/* Only this write's blocks are pending, and its caller is told it failed, so they are
+		   not kept for a later flush to write behind its back. */
+		if (wc_flush() == -1) {
+			wc_count = 0;
+			return -1;
 		}
 	}
+	else if (wc_count >= wc_limit && wc_flush() == -1) {
+		return -1;
+	}
 	return write_len;
 }
 
+/* The public entry points below take mdadm_mutex around the functions above, so several threads
+   can share one mounted array. */
+int mdadm_mount(void) {
+	uint64_t start = iotrace_begin();
+	mdadm_lock();
+	int r = mount_locked();
+	mdadm_unlock();
+	iotrace_record(start,TRACE_MOUNT,0,0,0,0,r == -1);
+	return r;
+}
+
+int mdadm_unmount(void) {
+	uint64_t start = iotrace_begin();
+	mdadm_lock();
+	int r = unmount_locked();
+	mdadm_unlock();
+	iotrace_record(start,TRACE_UNMOUNT,0,0,0,0,r == -1);
+	return r;
+}
+
+/* Reads and writes are recorded with the time spent waiting for mdadm_mutex included, since
+   that is what the caller sees. */
+int mdadm_read(uint32_t start_addr, uint32_t read_len, uint8_t *read_buf) {
+	uint64_t start = iotrace_begin();
+	mdadm_lock();
+	catch_up();
+	op_misses = 0;
+	int r = read_locked(start_addr,read_len,read_buf);
+	int misses = op_misses;
+	mdadm_unlock();
+	iotrace_record(start,TRACE_READ,start_addr,read_len,0,misses,r == -1);
+	return r;
+}
+
+int mdadm_write(uint32_t start_addr, uint32_t write_len, const uint8_t *write_buf) {
+	uint64_t start = iotrace_begin();
+	mdadm_lock();
+	catch_up();
+	op_misses = 0;
+	int r = write_locked(start_addr,write_len,write_buf);
+	int misses = op_misses;
+	mdadm_unlock();
+	iotrace_record(start,TRACE_WRITE,start_addr,write_len,
+		write_len > 0 && write_buf != NULL ? write_buf[0] : 0,misses,r == -1);
+	return r;
+}
+
+/* This function prints how often callers found mdadm_mutex taken and how long they waited. */
+void mdadm_print_lock_stats(void) {
+	fprintf(stderr, "lock_acquisitions: %ld, contended: %ld (%.1f%%), wait: %.3f ms\n",
+		lock_acquisitions, lock_contended,
+		lock_acquisitions ? 100.0 * lock_contended / lock_acquisitions : 0.0, lock_wait_ms);
+	fprintf(stderr, "lock held: %.3f ms, in JBOD operations: %.3f ms, in mdadm and the cache: %.3f ms\n",
+		lock_held_ms, lock_jbod_ms, lock_held_ms - lock_jbod_ms);
+	fprintf(stderr, "(every call takes the one mdadm lock, so the wait covers all of it)\n");
+}
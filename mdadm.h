@@ -5,6 +5,13 @@
 #include "jbod.h"
 #include "cache.h"
 
+/* Largest number of bytes a single mdadm_read or mdadm_write may transfer. */
+#define MDADM_MAX_IO_SIZE 1024
+
+/* mdadm_mount, mdadm_unmount, mdadm_read, mdadm_write, mdadm_flush and
+ * mdadm_snapshot_read may be called from several threads at once; they are
+ * serialized on a single lock inside mdadm. */
+
 /* Return 1 on success and -1 on failure */
 int mdadm_mount(void);
 
@@ -23,4 +30,60 @@ int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf);
 /* Return the number of bytes written on success, -1 on failure. */
 int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf);
 
+/* Return 1 on success and -1 on failure. Writes out everything mdadm_write
+ * has buffered. Needed before looking at the JBOD other than through mdadm. */
+int mdadm_flush(void);
+
+/* Return 1 on success and -1 on failure. Sends every JBOD operation to the
+ * server connected with jbod_connect instead of the in-process JBOD (or back,
+ * if |enable| is false). Only allowed while the array is unmounted. */
+int mdadm_use_server(bool enable);
+
+/* Return 1 on success and -1 on failure. Sets how many blocks mdadm_write may
+ * buffer before they are written out (at most 16). The default, 0, writes
+ * every call through before it returns; so does any batch size while a journal
+ * is open, since a buffered write is reported as done before it is durable, and
+ * on the server, where other clients could not see it yet. */
+int mdadm_set_write_batch(int blocks);
+
+/* Turns on or off (it starts on) reading ahead across disk boundaries: a
+ * sequential run of reads about to reach the next disk has the seek and the
+ * blocks around it pipelined to the server. It only applies to the server. */
+void mdadm_set_read_ahead(bool enable);
+
+/* Copies the CRC32C mdadm has on record for |disk_num|/|block_num| into |crc|.
+ * Return 1 on success and -1 if the block's contents are not known. */
+int mdadm_block_checksum(int disk_num, int block_num, uint32_t *crc);
+
+/* Checks every block with a checksum on record against it: cached blocks
+ * against their cached copy, with no JBOD operation, and with |deep| set the
+ * rest by reading them back from the JBOD. Mismatches are reported on stderr.
+ * Return the number of mismatches, or -1 if the array is not mounted. */
+int mdadm_verify(bool deep);
+
+/* Return 1 on success and -1 on failure. Takes a copy-on-write snapshot of the
+ * array; blocks are only copied when they are first overwritten afterwards.
+ * The snapshot is dropped when the array is unmounted. */
+int mdadm_snapshot_create(void);
+
+/* Return 1 on success and -1 on failure. Drops the snapshot. */
+int mdadm_snapshot_delete(void);
+
+/* Return the number of bytes read from the snapshot on success, -1 on failure,
+ * including once another client of the server has overwritten a block the
+ * snapshot had not preserved yet. */
+int mdadm_snapshot_read(uint32_t addr, uint32_t len, uint8_t *buf);
+
+/* Prints the JBOD operations mdadm answered or dropped locally. */
+void mdadm_print_io_stats(void);
+
+/* Prints how often mdadm's lock was contended, the time spent waiting, and how
+ * the time it was held splits between JBOD operations and mdadm and the cache.
+ * Every entry point takes the same lock, so contention here says how much the
+ * calls serialize as a whole, not which of those parts is to blame. */
+void mdadm_print_lock_stats(void);
+
+/* Prints the copy-on-write counters and write amplification of the snapshot. */
+void mdadm_print_snapshot_stats(void);
+
 #endif
@@ -5,8 +5,12 @@
 #include <stdio.h>
 #include <errno.h>
 #include <err.h>
+#include <sched.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include "net.h"
 #include "jbod.h"
@@ -14,34 +18,73 @@
 /* the client socket descriptor for the connection to the server */
 int cli_sd = -1;
 
-/* attempts to read n (len) bytes from fd; returns true on success and false on failure. 
-It may need to call the system call "read" multiple times to reach the given size len. 
-*/
-static bool nread(int fd, int len, uint8_t *buf) {
+/* the shared memory channel to the server, when connected with jbod_connect_shm instead of a
+   socket */
+static jbod_shm_channel_t *cli_shm = NULL;
+
+/* requests sent with jbod_client_send whose replies have not been taken yet and, over shared
+   memory, the request slots their blocks come back in */
+static int num_outstanding = 0;
+static jbod_shm_slot_t *outstanding_slots[JBOD_MAX_PIPELINE];
+
+/* called for each block the server says another client has overwritten */
+static void (*invalidation_handler)(int disk_num, int block_num) = NULL;
+
+/* attempts to read n (len) bytes from fd; returns true on success and false on failure, including
+when fd reaches end of file first. It may need to call the system call "read" multiple times to
+reach the given size len. */
+bool nread(int fd, int len, uint8_t *buf) {
   int bytes_read = 0;  // This variable accounts for the bytes read until a certain point.
-  
+
   while (bytes_read < len) {  // While loop is in place to make sure all bytes are read.
     int bytes = read(fd, &buf[bytes_read], len-bytes_read);
-    bytes_read += bytes;  // Number of bytes read until this point is tracked.
-    if (bytes_read >= len) { // Makes sure that the while loop is terminated when the correct number of bytes is read.
-      return true;
+    if (bytes <= 0) {  // An error, or the other end closing, ends the read short.
+      return false;
     }
+    bytes_read += bytes;  // Number of bytes read until this point is tracked.
   }
   return true;
 }
 
-/* attempts to write n bytes to fd; returns true on success and false on failure 
-It may need to call the system call "write" multiple times to reach the size len.
-*/
-static bool nwrite(int fd, int len, uint8_t *buf) {
+/* attempts to write n bytes to fd; returns true on success and false on failure */
+bool nwrite(int fd, int len, const uint8_t *buf) {
   int bytes_written = 0; // This variable accounts for the bytes written to until a certain point.
-  
+
   while (bytes_written < len) { // While loop is in place to make sure all bytes are written.
     int bytes = write(fd, &buf[bytes_written], len-bytes_written);
-    bytes_written += bytes; // Number of bytes written until this point is tracked.
-    if (bytes_written >= len) { // Makes sure that the while loop is terminated when the correct number of bytes is written to.
-      return true;
+    if (bytes <= 0) {
+      return false;
     }
+    bytes_written += bytes; // Number of bytes written until this point is tracked.
+  }
+  return true;
+}
+
+/* passes one invalidated block, as a disk << 8 | block key, on to the registered handler */
+static void deliver_invalidation(uint16_t key) {
+  if (invalidation_handler != NULL) {
+    invalidation_handler(key >> 8, key & 0xff);
+  }
+}
+
+void jbod_set_invalidation_handler(void (*fn)(int disk_num, int block_num)) {
+  invalidation_handler = fn;
+}
+
+/* reads the count and keys that follow the header of an invalidation push from sd and delivers
+   them; returns true on success and false on failure */
+static bool recv_invalidations(int sd) {
+  uint16_t count;
+  uint16_t keys[JBOD_MAX_INVALIDATIONS];
+  if (!nread(sd, sizeof(count), (uint8_t *) &count)) {
+    return false;
+  }
+  count = ntohs(count);
+  if (count > JBOD_MAX_INVALIDATIONS || !nread(sd, count * sizeof(uint16_t), (uint8_t *) keys)) {
+    return false;
+  }
+  for (int i = 0; i < count; i++) {
+    deliver_invalidation(ntohs(keys[i]));
   }
   return true;
 }
@@ -63,21 +106,26 @@ a block of data from the server. You may use the above nread function here.
 static bool recv_packet(int sd, uint32_t *op, uint8_t *ret, uint8_t *block) {
   uint8_t* header = malloc(HEADER_LEN);  // Header is malloced to provide space for the read operation to execute.
 
-  if (!nread(sd, HEADER_LEN, header)) { // The nread is wrapped in the if statement to account for fails.
-    free(header);
-    return false;
-  }
+  do {
+    if (!nread(sd, HEADER_LEN, header)) { // The nread is wrapped in the if statement to account for fails.
+      free(header);
+      return false;
+    }
+    memcpy(ret,&header[4],1);
+    // Invalidations the server pushed before this reply are handled first, in the order they came.
+    if ((*ret & INFO_INVALIDATIONS) && !recv_invalidations(sd)) {
+      free(header);
+      return false;
+    }
+  } while (*ret & INFO_INVALIDATIONS);
 
   memcpy(op,header,4);
   *op = ntohl(*op);  // The opcode is converted back to a regular byte.
-  memcpy(ret,&header[4],1);
 
-  if ((*ret >> 1) == 0) {  // This bitshift is to access the second-last bit of the ret byte, and determine if we need to access data.
+  if ((*ret & INFO_HAS_BLOCK) && !nread(sd,JBOD_BLOCK_SIZE,block)) {  // The second-last bit of the ret byte determines if we need to access data.
     free(header);
-    return true;
+    return false;
   }
-
-  nread(sd,JBOD_BLOCK_SIZE,block); // Rest of the read operation is conducted.
   free(header);
   return true;
 }
@@ -157,10 +205,185 @@ bool jbod_connect(const char *ip, uint16_t port) {
 
 
 
-/* disconnects from the server and resets cli_sd */
+/* attempts to connect to a server on this host through the Unix domain socket at path and set
+ * cli_sd to the socket; the packets are the same as over TCP. Returns true if successful and
+ * false if not. */
+bool jbod_connect_unix(const char *path) {
+  struct sockaddr_un uaddr;
+
+  memset(&uaddr, 0, sizeof(uaddr));
+  uaddr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(uaddr.sun_path)) {
+    return false;
+  }
+  strcpy(uaddr.sun_path, path);
+
+  cli_sd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (cli_sd == -1) {
+    printf("Error on socket creation [%s]\n", strerror(errno));
+    return false;
+  }
+
+  if (connect(cli_sd, (const struct sockaddr *)&uaddr, sizeof(uaddr)) == -1) {
+    printf("Error on socket connect [%s]\n", strerror(errno));
+    close(cli_sd);
+    cli_sd = -1;
+    return false;
+  }
+  return true;
+}
+
+/* attempts to attach to the shared memory channel a server on this host created under name.
+ * Only one client can be attached at a time. Returns true if successful and false if not. */
+bool jbod_connect_shm(const char *name) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) {
+    printf("Error on shm_open [%s]\n", strerror(errno));
+    return false;
+  }
+  jbod_shm_channel_t *ch = mmap(NULL, sizeof(jbod_shm_channel_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ch == MAP_FAILED) {
+    return false;
+  }
+
+  uint32_t detached = 0;
+  if (ch->magic != JBOD_SHM_MAGIC || !atomic_compare_exchange_strong(&ch->attached, &detached, 1)) {
+    munmap(ch, sizeof(jbod_shm_channel_t));
+    return false;
+  }
+  cli_shm = ch;
+  return true;
+}
+
+bool jbod_connect_transport(const char *transport) {
+  if (strcmp(transport, "unix") == 0) {
+    return jbod_connect_unix(JBOD_SOCKET_PATH);
+  }
+  if (strcmp(transport, "shm") == 0) {
+    return jbod_connect_shm(JBOD_SHM_NAME);
+  }
+  if (strcmp(transport, "tcp") == 0) {
+    return jbod_connect(JBOD_SERVER, JBOD_PORT);
+  }
+  return false;
+}
+
+/* disconnects from the server and resets cli_sd (or detaches from the shared memory channel) */
 void jbod_disconnect(void) {
+  if (cli_shm != NULL) {
+    atomic_store(&cli_shm->attached, 0);
+    munmap(cli_shm, sizeof(jbod_shm_channel_t));
+    cli_shm = NULL;
+    num_outstanding = 0;
+    return;
+  }
   close(cli_sd);
   cli_sd = -1;
+  num_outstanding = 0;
+}
+
+jbod_shm_slot_t *jbod_ring_reserve(jbod_shm_ring_t *ring) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == JBOD_SHM_SLOTS) {
+    return NULL;
+  }
+  return &ring->slots[head % JBOD_SHM_SLOTS];
+}
+
+void jbod_ring_publish(jbod_shm_ring_t *ring) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+jbod_shm_slot_t *jbod_ring_peek(jbod_shm_ring_t *ring) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+    return NULL;
+  }
+  return &ring->slots[tail % JBOD_SHM_SLOTS];
+}
+
+void jbod_ring_release(jbod_shm_ring_t *ring) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/* Puts a request on the shared memory channel and returns its slot, or NULL if the ring is
+   full. */
+static jbod_shm_slot_t *shm_send(uint32_t op, uint8_t *block) {
+  jbod_shm_slot_t *req = jbod_ring_reserve(&cli_shm->requests);
+  if (req == NULL) {
+    return NULL;
+  }
+  req->op = op;
+  req->info = 0;
+  if (block != NULL) {
+    req->info = INFO_HAS_BLOCK;
+    memcpy(req->block, block, JBOD_BLOCK_SIZE);
+  }
+  jbod_ring_publish(&cli_shm->requests);
+  return req;
+}
+
+/* Waits for the completion of the oldest request, sent in slot req. The completion says how it
+   went; any block comes back in the request slot, which the server fills in place. The slot is
+   not reused before this, since fewer requests than there are slots are ever outstanding. */
+static int shm_recv(jbod_shm_slot_t *req, uint8_t *block) {
+  /* Spinning only helps if the server has a CPU of its own to run on meanwhile. */
+  static int max_spins = -1;
+  if (max_spins == -1) {
+    max_spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 1000 : 0;
+  }
+  jbod_shm_slot_t *resp;
+  for (int spins = 0; (resp = jbod_ring_peek(&cli_shm->completions)) == NULL; spins++) {
+    if (spins >= max_spins) {
+      sched_yield();
+    }
+  }
+  uint8_t info = resp->info;
+  jbod_ring_release(&cli_shm->completions);
+
+  if ((info & INFO_HAS_BLOCK) && block != NULL) {
+    memcpy(block, req->block, JBOD_BLOCK_SIZE);
+  }
+  return (info & INFO_FAILED) ? -1 : 0;
+}
+
+/* Carries out one operation over the shared memory channel. */
+static int shm_operation(uint32_t op, uint8_t *block) {
+  jbod_shm_slot_t *req = shm_send(op, block);
+  if (req == NULL) {
+    return -1;
+  }
+  return shm_recv(req, block);
+}
+
+
+
+/* Delivers what the server has pushed so far. Between operations the only thing that can be
+   waiting on the socket is an invalidation push, so a peek that finds any byte at all means a
+   whole push is on its way. Over shared memory the keys are in their own ring. */
+void jbod_poll_invalidations(void) {
+  if (cli_shm != NULL) {
+    jbod_shm_invalidations_t *inv = &cli_shm->invalidations;
+    uint32_t tail = atomic_load_explicit(&inv->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&inv->head, memory_order_acquire);
+    for (; tail != head; tail++) {
+      deliver_invalidation(inv->keys[tail % JBOD_SHM_INVALIDATIONS]);
+    }
+    atomic_store_explicit(&inv->tail, tail, memory_order_release);
+    return;
+  }
+
+  uint8_t header[HEADER_LEN];
+  while (cli_sd != -1 && num_outstanding == 0 &&
+         recv(cli_sd, header, 1, MSG_PEEK | MSG_DONTWAIT) == 1) {
+    if (!nread(cli_sd, HEADER_LEN, header) || !(header[4] & INFO_INVALIDATIONS) ||
+        !recv_invalidations(cli_sd)) {
+      return;
+    }
+  }
 }
 
 
@@ -172,6 +395,10 @@ The meaning of each parameter is the same as in the original jbod_operation func
 return: 0 means success, -1 means failure.
 */
 int jbod_client_operation(uint32_t op, uint8_t *block) {
+  if (cli_shm != NULL) {
+    return shm_operation(op, block);
+  }
+
   uint32_t* rop = malloc(4); // Variable to store returned op code.
   uint8_t* rret = malloc(1); // Variable to store returned ret value.
   uint8_t signifier; // Signifier is initialized, and will store last bit of rret value.
@@ -198,3 +425,44 @@ int jbod_client_operation(uint32_t op, uint8_t *block) {
     return 0;
   }
 }
+
+int jbod_client_send(uint32_t op, uint8_t *block) {
+  if (num_outstanding == JBOD_MAX_PIPELINE) {
+    return -1;
+  }
+  if (cli_shm != NULL) {
+    jbod_shm_slot_t *req = shm_send(op, block);
+    if (req == NULL) {
+      return -1;
+    }
+    outstanding_slots[num_outstanding++] = req;
+    return 0;
+  }
+  if (!send_packet(cli_sd, op, block)) {
+    return -1;
+  }
+  num_outstanding++;
+  return 0;
+}
+
+int jbod_client_recv(uint8_t *block) {
+  if (num_outstanding == 0) {
+    return -1;
+  }
+  if (cli_shm != NULL) {
+    jbod_shm_slot_t *req = outstanding_slots[0];
+    memmove(outstanding_slots, outstanding_slots + 1, --num_outstanding * sizeof(jbod_shm_slot_t *));
+    return shm_recv(req, block);
+  }
+  num_outstanding--;
+  uint32_t op;
+  uint8_t ret;
+  uint8_t buf[JBOD_BLOCK_SIZE];
+  if (!recv_packet(cli_sd, &op, &ret, buf)) {
+    return -1;
+  }
+  if ((ret & INFO_HAS_BLOCK) && block != NULL) {
+    memcpy(block, buf, JBOD_BLOCK_SIZE);
+  }
+  return (ret & INFO_FAILED) ? -1 : 0;
+}
@@ -3,13 +3,137 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+
+#include "jbod.h"
 
 #define HEADER_LEN (sizeof(uint32_t) + sizeof(uint8_t))
 #define JBOD_SERVER "127.0.0.1"
 #define JBOD_PORT 3333
 
+/* Where a server on the same host listens for the Unix socket and shared
+ * memory transports. */
+#define JBOD_SOCKET_PATH "/tmp/jbod.sock"
+#define JBOD_SHM_NAME "/jbod-shm"
+#define JBOD_SHM_MAGIC 0x4a42534d  /* "JBSM" */
+#define JBOD_SHM_SLOTS 16
+
+/* Commands only cache_server understands, numbered after the JBOD's own; the
+ * JBOD itself and jbod_server fail them. GET_GENERATION returns in the first
+ * 8 bytes of the block, most significant first, a number that changes
+ * whenever the array's contents may have: it is drawn afresh when the JBOD is
+ * mounted and bumped by every write. HOLD_BLOCKS sends a bitmap of 2048
+ * blocks, starting at the disk in the opcode, that the client holds from an
+ * earlier session, so that other clients' writes to them are pushed to it
+ * like those to blocks it read. FILL_BLOCK is a WRITE_BLOCK of a block whose
+ * every byte is the block field of the opcode, sent without the block. */
+#define JBOD_GET_GENERATION (JBOD_NUM_CMDS + 0)
+#define JBOD_HOLD_BLOCKS (JBOD_NUM_CMDS + 1)
+#define JBOD_HOLD_BLOCKS_PER_OP (JBOD_BLOCK_SIZE * 8)
+#define JBOD_FILL_BLOCK (JBOD_NUM_CMDS + 2)
+
+/* Bits of the info code. A packet with INFO_INVALIDATIONS set is not a reply
+ * but an invalidation the server pushed unasked: its header is followed by a
+ * 16 bit count and that many 16 bit keys, disk << 8 | block, of blocks another
+ * client has overwritten since this client last read or wrote them. One push
+ * carries at most JBOD_MAX_INVALIDATIONS keys. */
+#define INFO_FAILED 0x1
+#define INFO_HAS_BLOCK 0x2
+#define INFO_INVALIDATIONS 0x4
+#define JBOD_MAX_INVALIDATIONS 64
+
+/* One entry of a shared memory ring: the same opcode and info code as a
+ * packet, with the block carried in place. The server reads into and writes
+ * from the request slot itself; a completion only carries the result. */
+typedef struct {
+  uint32_t op;
+  uint8_t info;
+  uint8_t block[JBOD_BLOCK_SIZE];
+} jbod_shm_slot_t;
+
+/* Lock-free single-producer single-consumer ring. head and tail only ever
+ * grow, and sit on separate cache lines so the two sides do not share one. */
+typedef struct {
+  _Atomic uint32_t head;
+  uint8_t pad1[60];
+  _Atomic uint32_t tail;
+  uint8_t pad2[60];
+  jbod_shm_slot_t slots[JBOD_SHM_SLOTS];
+} jbod_shm_ring_t;
+
+/* The keys of invalidated blocks the server pushes to a shared memory client,
+ * in a ring laid out like jbod_shm_ring_t. The server only pushes a block the
+ * client has fetched since the last push of it, and the client drains the ring
+ * on every call, so twice the number of blocks is more than enough room. */
+#define JBOD_SHM_INVALIDATIONS (2 * JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+
+typedef struct {
+  _Atomic uint32_t head;
+  uint8_t pad1[60];
+  _Atomic uint32_t tail;
+  uint8_t pad2[60];
+  uint16_t keys[JBOD_SHM_INVALIDATIONS];
+} jbod_shm_invalidations_t;
+
+/* The shared memory object a server creates for one client at a time. */
+typedef struct {
+  uint32_t magic;
+  _Atomic uint32_t attached;
+  jbod_shm_ring_t requests;
+  jbod_shm_ring_t completions;
+  jbod_shm_invalidations_t invalidations;
+} jbod_shm_channel_t;
+
 int jbod_client_operation(uint32_t op, uint8_t *block);
 bool jbod_connect(const char *ip, uint16_t port);
+
+/* Read or write exactly |len| bytes at |buf| from or to |fd|, calling read or
+ * write as often as it takes. Return false on an error, or if |fd| reaches end
+ * of file first; the client, the server and the journal all use them. */
+bool nread(int fd, int len, uint8_t *buf);
+bool nwrite(int fd, int len, const uint8_t *buf);
 void jbod_disconnect(void);
 
+/* Pipelined operations. jbod_client_send sends a request without waiting for
+ * its reply, and jbod_client_recv takes the replies in the order the requests
+ * were sent, copying any block a reply carries into |block|. Both return 0 on
+ * success and -1 on failure, of the operation or of the connection. At most
+ * JBOD_MAX_PIPELINE requests can be outstanding (the shared memory rings must
+ * keep a free slot), and every reply must be taken before the next
+ * jbod_client_operation. */
+#define JBOD_MAX_PIPELINE (JBOD_SHM_SLOTS - 1)
+int jbod_client_send(uint32_t op, uint8_t *block);
+int jbod_client_recv(uint8_t *block);
+
+/* Registers |fn| to be called for every block the server reports as
+ * overwritten by another client. It is called from jbod_poll_invalidations,
+ * and from jbod_client_operation and jbod_client_recv for pushes that arrive
+ * ahead of a reply. */
+void jbod_set_invalidation_handler(void (*fn)(int disk_num, int block_num));
+
+/* Hands every invalidation the server has pushed so far to the handler,
+ * without waiting for more. A client that caches blocks calls it before
+ * trusting its cache. Does nothing over a socket while pipelined replies are
+ * outstanding; their pushes come with them. */
+void jbod_poll_invalidations(void);
+
+/* Connect to a server on the same host over a Unix domain socket at |path|,
+ * or over the shared memory object |name|. Return true on success. Either
+ * replaces jbod_connect; jbod_client_operation is used the same way. */
+bool jbod_connect_unix(const char *path);
+bool jbod_connect_shm(const char *name);
+
+/* Connects with the default address of the transport named "tcp", "unix" or
+ * "shm". Returns true on success. */
+bool jbod_connect_transport(const char *transport);
+
+/* Ring operations shared by client and server. reserve returns the slot to
+ * fill next, or NULL if the ring is full, and publish hands it over; peek
+ * returns the oldest published slot, or NULL if there is none, and release
+ * gives it back. */
+jbod_shm_slot_t *jbod_ring_reserve(jbod_shm_ring_t *ring);
+void jbod_ring_publish(jbod_shm_ring_t *ring);
+jbod_shm_slot_t *jbod_ring_peek(jbod_shm_ring_t *ring);
+void jbod_ring_release(jbod_shm_ring_t *ring);
+
 #endif
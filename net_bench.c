@@ -0,0 +1,91 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jbod.h"
+#include "net.h"
+
+/* Measures the round trip of a JBOD operation to a running server over each transport it is
+ * given, e.g. against cache_server -u -m:
+ *
+ *   usage: net_bench [-n operations] [tcp] [unix] [shm]
+ *
+ * Every operation reads one block, so it carries a block back as well as the header.
+ */
+
+static uint32_t encode_op(jbod_cmd_t cmd, int disk_num, int block_num) {
+  return cmd << 12 | disk_num << 8 | block_num;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static void bench(const char *transport, int num_ops, double *lat) {
+  if (!jbod_connect_transport(transport)) {
+    printf("%-5s cannot connect\n", transport);
+    return;
+  }
+  if (jbod_client_operation(encode_op(JBOD_MOUNT, 0, 0), NULL) == -1) {
+    printf("%-5s cannot mount\n", transport);
+    jbod_disconnect();
+    return;
+  }
+
+  uint8_t block[JBOD_BLOCK_SIZE];
+  jbod_client_operation(encode_op(JBOD_SEEK_TO_DISK, 0, 0), NULL);
+  for (int i = 0; i < num_ops; i++) {
+    if (i % JBOD_NUM_BLOCKS_PER_DISK == 0) {
+      jbod_client_operation(encode_op(JBOD_SEEK_TO_BLOCK, 0, 0), NULL);
+    }
+    double start = now_ns();
+    jbod_client_operation(encode_op(JBOD_READ_BLOCK, 0, 0), block);
+    lat[i] = now_ns() - start;
+  }
+
+  jbod_client_operation(encode_op(JBOD_UNMOUNT, 0, 0), NULL);
+  jbod_disconnect();
+
+  double total = 0;
+  for (int i = 0; i < num_ops; i++) {
+    total += lat[i];
+  }
+  qsort(lat, num_ops, sizeof(double), compare_double);
+  printf("%-5s mean %8.0f ns  p50 %8.0f ns  p99 %8.0f ns  max %8.0f ns\n", transport,
+         total / num_ops, lat[num_ops / 2], lat[num_ops * 99 / 100], lat[num_ops - 1]);
+}
+
+int main(int argc, char *argv[]) {
+  int num_ops = 100000;
+  int first = 1;
+  if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+    num_ops = atoi(argv[2]);
+    first = 3;
+  }
+  if (num_ops <= 0) {
+    fprintf(stderr, "usage: %s [-n operations] [tcp] [unix] [shm]\n", argv[0]);
+    return 1;
+  }
+
+  double *lat = malloc(num_ops * sizeof(double));
+  if (first == argc) {
+    bench("tcp", num_ops, lat);
+    bench("unix", num_ops, lat);
+    bench("shm", num_ops, lat);
+  }
+  for (int i = first; i < argc; i++) {
+    bench(argv[i], num_ops, lat);
+  }
+  free(lat);
+  return 0;
+}
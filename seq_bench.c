@@ -0,0 +1,128 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jbod.h"
+#include "mdadm.h"
+#include "net.h"
+
+/* Reads the whole array front to back through mdadm and a running server, alternating passes
+ * with read-ahead across disk boundaries off and on, e.g. against cache_server -u -m:
+ *
+ *   usage: seq_bench [-n passes] [-l read-length] [tcp|unix|shm]
+ *
+ * The reads near a disk boundary (within NEAR_BLOCKS blocks of one) are timed apart from the
+ * rest, since they are the ones the seek to the next disk used to stall.
+ */
+
+#define NEAR_BLOCKS 4
+
+typedef struct {
+  double total_ns;
+  double near_ns;
+  double inside_ns;
+  long near_reads;
+  long inside_reads;
+} pass_t;
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns true if [addr, addr + len) touches a block within NEAR_BLOCKS of a boundary between
+ * two disks. */
+static bool near_boundary(uint32_t addr, uint32_t len) {
+  for (uint32_t b = addr / JBOD_BLOCK_SIZE; b <= (addr + len - 1) / JBOD_BLOCK_SIZE; b++) {
+    int block = b % JBOD_NUM_BLOCKS_PER_DISK;
+    int disk = b / JBOD_NUM_BLOCKS_PER_DISK;
+    if ((block < NEAR_BLOCKS && disk > 0) ||
+        (block >= JBOD_NUM_BLOCKS_PER_DISK - NEAR_BLOCKS && disk < JBOD_NUM_DISKS - 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Mounts afresh, so nothing mdadm learnt in the last pass answers reads in this one, and reads
+ * the array through once. Returns false if anything fails. */
+static bool run_pass(uint32_t len, bool read_ahead, pass_t *p) {
+  uint8_t buf[MDADM_MAX_IO_SIZE];
+  mdadm_set_read_ahead(read_ahead);
+  if (mdadm_mount() != 1) {
+    return false;
+  }
+  double start = now_ns();
+  for (uint32_t addr = 0; addr + len <= JBOD_NUM_DISKS * JBOD_DISK_SIZE; addr += len) {
+    double t = now_ns();
+    if (mdadm_read(addr, len, buf) != (int) len) {
+      mdadm_unmount();
+      return false;
+    }
+    t = now_ns() - t;
+    if (near_boundary(addr, len)) {
+      p->near_ns += t;
+      p->near_reads++;
+    } else {
+      p->inside_ns += t;
+      p->inside_reads++;
+    }
+  }
+  p->total_ns += now_ns() - start;
+  return mdadm_unmount() == 1;
+}
+
+static void report(const char *name, const pass_t *p, int passes) {
+  double mb = (double) passes * JBOD_NUM_DISKS * JBOD_DISK_SIZE / (1 << 20);
+  printf("read-ahead %-3s %8.2f MiB/s  near a boundary %8.0f ns/read  inside a disk %8.0f ns/read\n",
+         name, mb / (p->total_ns / 1e9), p->near_ns / p->near_reads,
+         p->inside_ns / p->inside_reads);
+}
+
+int main(int argc, char *argv[]) {
+  int passes = 10;
+  uint32_t len = JBOD_BLOCK_SIZE;
+  const char *transport = "tcp";
+  int i = 1;
+  for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+    if (strcmp(argv[i], "-n") == 0) {
+      passes = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-l") == 0) {
+      len = atoi(argv[i + 1]);
+    } else {
+      break;
+    }
+  }
+  if (i < argc) {
+    transport = argv[i++];
+  }
+  if (i != argc || passes <= 0 || len == 0 || len > MDADM_MAX_IO_SIZE) {
+    fprintf(stderr, "usage: %s [-n passes] [-l read-length] [tcp|unix|shm]\n", argv[0]);
+    return 1;
+  }
+
+  if (!jbod_connect_transport(transport) || mdadm_use_server(true) != 1) {
+    fprintf(stderr, "Cannot connect over %s\n", transport);
+    return 1;
+  }
+
+  /* Alternating the two keeps drift on the host from favouring either. */
+  pass_t off = { 0 }, on = { 0 };
+  for (int n = 0; n < passes; n++) {
+    if (!run_pass(len, false, &off) || !run_pass(len, true, &on)) {
+      fprintf(stderr, "A pass failed\n");
+      jbod_disconnect();
+      return 1;
+    }
+  }
+  jbod_disconnect();
+
+  printf("%s, %d passes of %u-byte reads\n", transport, passes, len);
+  report("off", &off, passes);
+  report("on", &on, passes);
+  return 0;
+}
@@ -10,6 +10,8 @@
 #include <fcntl.h>
 #include <err.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "cache.h"
 #include "jbod.h"
@@ -17,21 +19,60 @@
 #include "util.h"
 #include "tester.h"
 #include "net.h"
+#include "journal.h"
+#include "trace.h"
+#include "iotrace.h"
 
-#define TESTER_ARGUMENTS "hw:s:"
-#define USAGE                                               \
-  "USAGE: test [-h] [-w workload-file] [-s cache_size] \n"  \
-  "\n"                                                      \
-  "where:\n"                                                \
-  "    -h - help mode (display this message)\n"             \
-  "\n"                                                      \
+#define TESTER_ARGUMENTS "hw:s:p:j:c:t:a:q:b:rx:i:v"
+#define USAGE                                                                                      \
+  "USAGE: test [-h] [-w workload-file] [-s cache_size] [-p snapshot-file] [-j journal-file]\n"   \
+  "            [-c binary-trace-file] [-t threads] [-a target-hit-rate] [-q disk:min:max]\n"     \
+  "            [-b write-batch] [-r] [-x transport] [-i capture-file] [-v]\n"                  \
+  "\n"                                                                                             \
+  "where:\n"                                                                                       \
+  "    -h - help mode (display this message)\n"                                                    \
+  "    -p - keep the cache in snapshot-file across runs\n"                                         \
+  "    -j - journal multi-block writes to journal-file\n"                                          \
+  "    -c - convert the text workload-file to binary-trace-file and exit\n"                        \
+  "         (workload files in either format can be passed to -w)\n"                               \
+  "    -a - resize the cache towards target-hit-rate percent, up to cache_size entries\n"          \
+  "    -q - give disk its own cache partition of min to max entries (repeatable)\n"               \
+  "    -b - combine writes to at most write-batch blocks before writing them out\n"              \
+  "         (0, the default, writes every WRITE through immediately, as do -j and -r)\n"       \
+  "    -r - send mdadm's JBOD operations to the server (e.g. cache_server) instead of\n"         \
+  "         the in-process JBOD\n"                                                                \
+  "    -x - reach the server over tcp (default), unix (socket) or shm (shared memory)\n"         \
+  "    -i - record every mdadm call to the binary capture-file (see iotrace_tool)\n"             \
+  "    -v - check every block with a checksum on record against the JBOD before each UNMOUNT\n"  \
+  "    -t - replay READs and WRITEs on this many threads, each owning an equal slice\n"            \
+  "         of the address space (ops that straddle two slices run alone, as barriers)\n"          \
+  "\n"                                                                                             \
 
-int run_workload(char *workload, int cache_size);
+#define LATENCY_BUCKETS 40
+
+/* One replay thread of a multi-threaded run. Latencies are kept in a histogram
+ * of power-of-two nanosecond buckets. */
+typedef struct {
+  pthread_t thread;
+  int index;
+  int num_threads;
+  const trace_op_t *ops;
+  uint64_t begin, end;
+  uint64_t num_ops;
+  double total_ns, max_ns;
+  uint64_t latency[LATENCY_BUCKETS];
+} replay_thread_t;
+
+int run_workload(char *workload, int cache_size, int num_threads);
+
+static bool verify = false;
+static bool remote = false;
 
 int main(int argc, char *argv[])
 {
-  int ch, cache_size = 0;
-  char *workload = NULL;
+  int ch, cache_size = 0, num_threads = 1;
+  double target_hit_rate = 0;
+  char *workload = NULL, *convert = NULL, *transport = "tcp", *capture = NULL;
 
   while ((ch = getopt(argc, argv, TESTER_ARGUMENTS)) != -1) {
     switch (ch) {
@@ -44,6 +85,47 @@ int main(int argc, char *argv[])
       case 'w':
         workload = optarg;
         break;
+      case 'p':
+        cache_set_snapshot_file(optarg);
+        break;
+      case 'j':
+        if (journal_open(optarg) != 1)
+          err(1, "Cannot open journal file %s", optarg);
+        break;
+      case 'c':
+        convert = optarg;
+        break;
+      case 'a':
+        target_hit_rate = atof(optarg) / 100;
+        break;
+      case 'q': {
+        int disk, min, max;
+        if (sscanf(optarg, "%d:%d:%d", &disk, &min, &max) != 3 ||
+            cache_set_partition(disk, disk) != 1 || cache_set_quota(disk, min, max) != 1)
+          errx(1, "Invalid cache quota %s", optarg);
+        break;
+      }
+      case 'b':
+        if (mdadm_set_write_batch(atoi(optarg)) != 1)
+          errx(1, "Invalid write batch %s", optarg);
+        break;
+      case 'r':
+        remote = true;
+        break;
+      case 'x':
+        transport = optarg;
+        break;
+      case 'i':
+        capture = optarg;
+        break;
+      case 'v':
+        verify = true;
+        break;
+      case 't':
+        num_threads = atoi(optarg);
+        if (num_threads < 1)
+          errx(1, "Invalid number of threads %s", optarg);
+        break;
       default:
         fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
         return -1;
@@ -55,19 +137,31 @@ int main(int argc, char *argv[])
     return -1;
   }
 
-  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+  if (target_hit_rate > 0)
+    cache_set_target(target_hit_rate, cache_size);
+
+  if (convert) {
+    if (trace_convert(workload, convert) != 1)
+      errx(1, "Failed to convert %s to %s", workload, convert);
+    return 0;
+  }
+
+  if (!jbod_connect_transport(transport))
     return -1;
+  if (remote)
+    mdadm_use_server(true);
+  if (capture && iotrace_start(capture) != 1)
+    err(1, "Cannot create capture file %s", capture);
   
-  run_workload(workload, cache_size);
+  run_workload(workload, cache_size, num_threads);
+  iotrace_stop();
+  iotrace_print_stats();
   jbod_disconnect();
+  journal_close();
 
   return 0;
 }
 
-int equals(const char *s1, const char *s2) {
-  return strncmp(s1, s2, strlen(s2)) == 0;
-}
-
 static uint32_t encode_op(jbod_cmd_t cmd, int disk_num, int block_num) {
   assert(cmd >= 0 && cmd < JBOD_NUM_CMDS);
   assert(block_num >= 0 && block_num < JBOD_NUM_BLOCKS_PER_DISK);
@@ -80,62 +174,259 @@ static uint32_t encode_op(jbod_cmd_t cmd, int disk_num, int block_num) {
   return op;
 }
 
-int run_workload(char *workload, int cache_size) {
-  char line[256], cmd[32];
-  uint8_t buf[MAX_IO_SIZE];
-  uint32_t addr, len, ch;
-  int rc;
-
-  memset(buf, 0, MAX_IO_SIZE);
-
-  FILE *f = fopen(workload, "r");
-  if (!f)
-    err(1, "Cannot open workload file %s", workload);
+/* Executes one workload operation; buf is scratch space of MAX_IO_SIZE bytes. */
+static int run_op(const trace_op_t *op, uint8_t *buf) {
+  int rc = 0;
 
-  if (cache_size) {
-    rc = cache_create(cache_size);
-    if (rc != 1)
-      errx(1, "Failed to create cache.");
-  }
-
-  int line_num = 0;
-  while (fgets(line, 256, f)) {
-    ++line_num;
-    line[strlen(line)-1] = '\0';
-    if (equals(line, "MOUNT")) {
+  switch (op->cmd) {
+    case TRACE_MOUNT:
       rc = mdadm_mount();
-    } else if (equals(line, "UNMOUNT")) {
+      break;
+    case TRACE_UNMOUNT:
+      if (verify)
+        mdadm_verify(true);
       rc = mdadm_unmount();
-    } else if (equals(line, "WRITE_PERMIT")) {
+      break;
+    case TRACE_WRITE_PERMIT:
       rc = mdadm_write_permission();
-    } else if (equals(line, "WRITE_PERMIT_REVOKE")) {
+      break;
+    case TRACE_WRITE_PERMIT_REVOKE:
       rc = mdadm_revoke_write_permission();
-    } else if (equals(line, "SIGNALL")) {
+      break;
+    case TRACE_SNAPSHOT:
+      rc = mdadm_snapshot_create();
+      break;
+    case TRACE_SIGNALL:
+      mdadm_flush();
       for (int i = 0; i < JBOD_NUM_DISKS; ++i)
         for (int j = 0; j < JBOD_NUM_BLOCKS_PER_DISK; ++j) {
           uint8_t b[JBOD_BLOCK_SIZE];
           jbod_client_operation(encode_op(JBOD_SIGN_BLOCK, i, j), b);
           fprintf(stdout, "%s", b);
         }
+      break;
+    case TRACE_READ:
+      rc = mdadm_read(op->addr, op->len, buf);
+      break;
+    case TRACE_WRITE:
+      memset(buf, op->ch, op->len);
+      rc = mdadm_write(op->addr, op->len, buf);
+      break;
+    case TRACE_CRASH:
+      /* Unmounts the JBOD behind mdadm's back, as if the process had died; the journal and
+         whatever mdadm had not written yet are left as they were. */
+      if (remote)
+        rc = jbod_client_operation(encode_op(JBOD_UNMOUNT, 0, 0), NULL);
+      else
+        rc = jbod_operation(encode_op(JBOD_UNMOUNT, 0, 0), NULL);
+      break;
+    case TRACE_SNAPSHOT_READ:
+      rc = mdadm_snapshot_read(op->addr, op->len, buf);
+      if (rc == op->len)
+        fprintf(stdout, "SNAPSHOT_READ %u %u : 0x%08x\n", op->addr, op->len, crc32c(buf, op->len));
+      else
+        fprintf(stdout, "SNAPSHOT_READ %u %u : failed\n", op->addr, op->len);
+      break;
+  }
+  return rc;
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/* Returns the size of the slice of the address space each of num_threads replay threads owns. */
+static uint32_t slice_size(int num_threads) {
+  return (JBOD_NUM_DISKS * JBOD_DISK_SIZE + num_threads - 1) / num_threads;
+}
+
+/* Returns true if op is a READ or WRITE that lies within a single slice, so a replay thread can
+ * run it without racing the thread that owns the next slice. */
+static bool in_one_slice(const trace_op_t *op, uint32_t slice) {
+  if (op->cmd != TRACE_READ && op->cmd != TRACE_WRITE)
+    return false;
+  return op->len == 0 || op->addr / slice == (op->addr + op->len - 1) / slice;
+}
+
+/* Replays the READs and WRITEs in [begin, end) whose address falls in this thread's slice. */
+static void *replay_thread(void *arg) {
+  replay_thread_t *t = arg;
+  uint8_t buf[MAX_IO_SIZE];
+  uint32_t slice = slice_size(t->num_threads);
+
+  memset(buf, 0, MAX_IO_SIZE);
+  for (uint64_t i = t->begin; i < t->end; ++i) {
+    if (t->ops[i].addr / slice != (uint32_t) t->index)
+      continue;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_op(&t->ops[i], buf);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = elapsed_ns(&start, &end);
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && ns >= (double) (2ull << bucket))
+      ++bucket;
+    t->latency[bucket]++;
+    t->total_ns += ns;
+    if (ns > t->max_ns)
+      t->max_ns = ns;
+    t->num_ops++;
+  }
+  return NULL;
+}
+
+/* Replays ops on num_threads threads. Runs of READs and WRITEs are split
+ * between the threads by address; every other command, and any READ or WRITE
+ * that straddles two slices, is a barrier and runs on the calling thread once
+ * the threads before it have finished. */
+static void replay_threaded(const trace_op_t *ops, uint64_t num_ops, int num_threads) {
+  replay_thread_t *threads = calloc(num_threads, sizeof(replay_thread_t));
+  uint8_t buf[MAX_IO_SIZE];
+  double wall_ns = 0;
+
+  uint32_t slice = slice_size(num_threads);
+  uint64_t barriers = 0;
+
+  memset(buf, 0, MAX_IO_SIZE);
+  for (uint64_t i = 0; i < num_ops; ) {
+    if (!in_one_slice(&ops[i], slice)) {
+      if (ops[i].cmd == TRACE_READ || ops[i].cmd == TRACE_WRITE)
+        ++barriers;
+      run_op(&ops[i++], buf);
+      continue;
+    }
+
+    uint64_t end = i;
+    while (end < num_ops && in_one_slice(&ops[end], slice))
+      ++end;
+
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < num_threads; ++t) {
+      threads[t].index = t;
+      threads[t].num_threads = num_threads;
+      threads[t].ops = ops;
+      threads[t].begin = i;
+      threads[t].end = end;
+      if (pthread_create(&threads[t].thread, NULL, replay_thread, &threads[t]) != 0)
+        errx(1, "Failed to start replay thread %d", t);
+    }
+    for (int t = 0; t < num_threads; ++t)
+      pthread_join(threads[t].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    wall_ns += elapsed_ns(&start, &stop);
+    i = end;
+  }
+
+  uint64_t total_ops = 0;
+  for (int t = 0; t < num_threads; ++t) {
+    replay_thread_t *r = &threads[t];
+    if (r->num_ops == 0) {
+      fprintf(stderr, "thread %d: idle, no ops fell in its slice\n", t);
+      continue;
+    }
+    uint64_t seen = 0;
+    int p99 = 0;
+    while (p99 < LATENCY_BUCKETS - 1 && (seen += r->latency[p99]) < r->num_ops - r->num_ops / 100)
+      ++p99;
+    fprintf(stderr, "thread %d: ops: %lu, mean: %.2f us, p99: < %.2f us, max: %.2f us\n",
+            t, (unsigned long) r->num_ops, r->total_ns / r->num_ops / 1e3,
+            (double) (2ull << p99) / 1e3, r->max_ns / 1e3);
+    total_ops += r->num_ops;
+  }
+  fprintf(stderr, "replay: %lu ops on %d threads in %.3f ms, %.0f ops/s\n",
+          (unsigned long) total_ops, num_threads, wall_ns / 1e6,
+          wall_ns > 0 ? total_ops / (wall_ns / 1e9) : 0.0);
+  fprintf(stderr, "replay: %lu ops straddled two slices and ran alone\n", (unsigned long) barriers);
+  mdadm_print_lock_stats();
+  free(threads);
+}
+
+/* Parses a whole text trace into memory, for the multi-threaded replay. */
+static trace_op_t *load_text_trace(FILE *f, uint64_t *num_ops) {
+  char line[256];
+  uint64_t n = 0, capacity = 1024;
+  trace_op_t *ops = malloc(capacity * sizeof(trace_op_t));
+
+  while (fgets(line, 256, f)) {
+    line[strlen(line)-1] = '\0';
+    if (n == capacity) {
+      capacity *= 2;
+      ops = realloc(ops, capacity * sizeof(trace_op_t));
+    }
+    if (trace_parse_line(line, &ops[n]) != 1)
+      errx(1, "Unknown command [%s] on line %lu, aborting.", line, (unsigned long) n + 1);
+    ++n;
+  }
+  *num_ops = n;
+  return ops;
+}
+
+int run_workload(char *workload, int cache_size, int num_threads) {
+  char line[256];
+  uint8_t buf[MAX_IO_SIZE];
+  trace_op_t op;
+  int rc;
+
+  memset(buf, 0, MAX_IO_SIZE);
+
+  if (cache_size) {
+    rc = cache_create(cache_size);
+    if (rc != 1)
+      errx(1, "Failed to create cache.");
+  }
+
+  /* Binary traces are replayed straight from the mapping with no parsing at all. */
+  if (trace_is_binary(workload)) {
+    uint64_t num_ops;
+    const trace_op_t *ops = trace_map(workload, &num_ops);
+    if (!ops)
+      errx(1, "Cannot map binary workload file %s", workload);
+    if (num_threads > 1) {
+      replay_threaded(ops, num_ops, num_threads);
     } else {
-      if (sscanf(line, "%7s %7u %4u %3u", cmd, &addr, &len, &ch) != 4)
-        errx(1, "Failed to parse command: [%s\n], aborting.", line);
-      if (equals(cmd, "READ")) {
-        rc = mdadm_read(addr, len, buf);
-      } else if (equals(cmd, "WRITE")) {
-        memset(buf, ch, len);
-        rc = mdadm_write(addr, len, buf);
-      } else {
+      for (uint64_t i = 0; i < num_ops; ++i)
+        run_op(&ops[i], buf);
+    }
+    trace_unmap(ops, num_ops);
+  } else if (num_threads > 1) {
+    FILE *f = fopen(workload, "r");
+    if (!f)
+      err(1, "Cannot open workload file %s", workload);
+    uint64_t num_ops;
+    trace_op_t *ops = load_text_trace(f, &num_ops);
+    fclose(f);
+    replay_threaded(ops, num_ops, num_threads);
+    free(ops);
+  } else {
+    FILE *f = fopen(workload, "r");
+    if (!f)
+      err(1, "Cannot open workload file %s", workload);
+
+    int line_num = 0;
+    while (fgets(line, 256, f)) {
+      ++line_num;
+      line[strlen(line)-1] = '\0';
+      if (trace_parse_line(line, &op) != 1)
         errx(1, "Unknown command [%s] on line %d, aborting.", line, line_num);
-      }
+      run_op(&op, buf);
     }
+    fclose(f);
   }
-  fclose(f);
 
-  if (cache_size)
+  if (cache_size) {
+    cache_print_storage();
+    cache_print_mrc();
+    cache_print_partitions();
     cache_destroy();
+  }
 
   cache_print_hit_rate();
+  mdadm_print_io_stats();
+  mdadm_print_snapshot_stats();
+  journal_print_stats();
 
   return 0;
 }
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mdadm.h"
+#include "trace.h"
+
+static const char *trace_cmd_text[] = {
+  "MOUNT",
+  "UNMOUNT",
+  "WRITE_PERMIT",
+  "WRITE_PERMIT_REVOKE",
+  "SIGNALL",
+  "SNAPSHOT",
+  "READ",
+  "WRITE",
+  "SNAPSHOT_READ",
+  "CRASH",
+};
+
+/* Commands that take no arguments, longest first so a prefix never shadows a longer name. */
+static const trace_cmd_t trace_bare_cmds[] = {
+  TRACE_WRITE_PERMIT_REVOKE,
+  TRACE_WRITE_PERMIT,
+  TRACE_UNMOUNT,
+  TRACE_MOUNT,
+  TRACE_SIGNALL,
+  TRACE_SNAPSHOT,
+  TRACE_CRASH,
+};
+
+/* Replay indexes by cmd and reads or writes len bytes into a MDADM_MAX_IO_SIZE buffer. */
+static bool trace_op_valid(const trace_op_t *op) {
+  return op->cmd < TRACE_NUM_CMDS && op->len <= MDADM_MAX_IO_SIZE;
+}
+
+static int equals(const char *s1, const char *s2) {
+  return strncmp(s1, s2, strlen(s2)) == 0;
+}
+
+int trace_parse_line(const char *line, trace_op_t *op) {
+  char cmd[32];
+  uint32_t addr, len, ch;
+
+  memset(op, 0, sizeof(*op));
+  /* Commands with arguments go first, since SNAPSHOT_READ starts with a bare command. */
+  if (sscanf(line, "%15s %7u %4u %3u", cmd, &addr, &len, &ch) != 4) {
+    for (size_t i = 0; i < sizeof(trace_bare_cmds) / sizeof(trace_bare_cmds[0]); ++i) {
+      if (equals(line, trace_cmd_text[trace_bare_cmds[i]])) {
+        op->cmd = trace_bare_cmds[i];
+        return 1;
+      }
+    }
+    return -1;
+  }
+  if (equals(cmd, "READ"))
+    op->cmd = TRACE_READ;
+  else if (equals(cmd, "WRITE"))
+    op->cmd = TRACE_WRITE;
+  else if (equals(cmd, "SNAPSHOT_READ"))
+    op->cmd = TRACE_SNAPSHOT_READ;
+  else
+    return -1;
+  if (ch > UINT8_MAX)
+    return -1;
+  op->addr = addr;
+  op->len = len;
+  op->ch = ch;
+  return trace_op_valid(op) ? 1 : -1;
+}
+
+void trace_print_op(FILE *f, const trace_op_t *op) {
+  if (op->cmd == TRACE_READ || op->cmd == TRACE_WRITE || op->cmd == TRACE_SNAPSHOT_READ)
+    fprintf(f, "%s %u %u %u\n", trace_cmd_text[op->cmd], op->addr, op->len, op->ch);
+  else
+    fprintf(f, "%s\n", trace_cmd_text[op->cmd]);
+}
+
+int trace_convert(const char *in, const char *out) {
+  FILE *fin = fopen(in, "r");
+  if (!fin)
+    return -1;
+  FILE *fout = fopen(out, "w");
+  if (!fout) {
+    fclose(fin);
+    return -1;
+  }
+
+  /* The header is rewritten with the real count once every line has been parsed. */
+  trace_header_t hdr = { TRACE_MAGIC, TRACE_VERSION, 0 };
+  fwrite(&hdr, sizeof(hdr), 1, fout);
+
+  char line[256];
+  trace_op_t op;
+  int rc = 1;
+  while (fgets(line, sizeof(line), fin)) {
+    if (trace_parse_line(line, &op) != 1) {
+      fprintf(stderr, "Failed to parse command: [%s], aborting.\n", line);
+      rc = -1;
+      break;
+    }
+    fwrite(&op, sizeof(op), 1, fout);
+    hdr.num_ops++;
+  }
+
+  fseek(fout, 0, SEEK_SET);
+  fwrite(&hdr, sizeof(hdr), 1, fout);
+  if (fclose(fout) != 0)
+    rc = -1;
+  fclose(fin);
+  return rc;
+}
+
+bool trace_is_binary(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return false;
+  uint32_t magic = 0;
+  bool binary = read(fd, &magic, sizeof(magic)) == sizeof(magic) && magic == TRACE_MAGIC;
+  close(fd);
+  return binary;
+}
+
+const trace_op_t *trace_map(const char *path, uint64_t *num_ops) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(trace_header_t)) {
+    close(fd);
+    return NULL;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  const trace_header_t *hdr = map;
+  if (hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION ||
+      sizeof(trace_header_t) + hdr->num_ops * sizeof(trace_op_t) > (size_t) st.st_size) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  /* Replay walks the file front to back exactly once. */
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  /* The file is not trusted: one pass over it here lets replay skip every check. */
+  const trace_op_t *ops = (const trace_op_t *) (hdr + 1);
+  for (uint64_t i = 0; i < hdr->num_ops; i++)
+    if (!trace_op_valid(&ops[i])) {
+      fprintf(stderr, "Invalid operation %lu in %s\n", (unsigned long) i, path);
+      munmap(map, st.st_size);
+      return NULL;
+    }
+
+  *num_ops = hdr->num_ops;
+  return ops;
+}
+
+void trace_unmap(const trace_op_t *ops, uint64_t num_ops) {
+  munmap((void *) ((const trace_header_t *) ops - 1), sizeof(trace_header_t) + num_ops * sizeof(trace_op_t));
+}
@@ -0,0 +1,63 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TRACE_MAGIC 0x4a425452  /* "JBTR" */
+#define TRACE_VERSION 1
+
+typedef enum {
+  TRACE_MOUNT,
+  TRACE_UNMOUNT,
+  TRACE_WRITE_PERMIT,
+  TRACE_WRITE_PERMIT_REVOKE,
+  TRACE_SIGNALL,
+  TRACE_SNAPSHOT,
+  TRACE_READ,
+  TRACE_WRITE,
+  TRACE_SNAPSHOT_READ,  /* Reads addr/len from the snapshot; ch is unused. */
+  TRACE_CRASH,          /* Unmounts the JBOD without mdadm, for testing recovery. */
+  TRACE_NUM_CMDS,
+} trace_cmd_t;
+
+/* One workload operation. A binary trace is a trace_header_t followed by
+ * num_ops of these, so it can be replayed straight out of an mmap. */
+typedef struct {
+  uint8_t cmd;
+  uint8_t ch;
+  uint16_t len;
+  uint32_t addr;
+} trace_op_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t num_ops;
+} trace_header_t;
+
+/* Returns 1 on success and -1 if |line| is not a valid text trace command,
+ * including one longer than MDADM_MAX_IO_SIZE. Parses one line of a text
+ * trace into |op|. */
+int trace_parse_line(const char *line, trace_op_t *op);
+
+/* Writes |op| as one line of a text trace to |f|. */
+void trace_print_op(FILE *f, const trace_op_t *op);
+
+/* Returns 1 on success and -1 on failure. Converts the text trace at |in| to
+ * the binary format at |out|. */
+int trace_convert(const char *in, const char *out);
+
+/* Returns true if the file at |path| is a binary trace. */
+bool trace_is_binary(const char *path);
+
+/* Maps the binary trace at |path| and returns its operations, storing their
+ * count in |num_ops|; returns NULL on failure, including when any operation
+ * has an unknown command or is longer than MDADM_MAX_IO_SIZE. Release with
+ * trace_unmap. */
+const trace_op_t *trace_map(const char *path, uint64_t *num_ops);
+
+void trace_unmap(const trace_op_t *ops, uint64_t num_ops);
+
+#endif
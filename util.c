@@ -1,9 +1,12 @@
 #include <err.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <assert.h>
+#include <pthread.h>
 #include <openssl/sha.h>
 #include <openssl/rand.h>
 
@@ -55,3 +58,55 @@ uint32_t get_rand(uint32_t min, uint32_t max) {
     v = max;
   return v;
 }
+
+/* CRC32C (Castagnoli) lookup table for the portable path and whether the CPU has SSE4.2, both
+   settled once by crc32c_init since any thread may be the first to checksum a block. */
+static uint32_t crc32c_table[256];
+static bool has_sse42 = false;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void) {
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; ++k)
+      c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+    crc32c_table[i] = c;
+  }
+#if defined(__x86_64__)
+  has_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, uint32_t size) {
+  for (uint32_t i = 0; i < size; ++i)
+    crc = crc32c_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+/* Same polynomial using the SSE4.2 crc32 instruction, eight bytes at a time. */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, uint32_t size) {
+  uint64_t c = crc;
+  while (size >= 8) {
+    uint64_t v;
+    memcpy(&v, buf, 8);
+    c = __builtin_ia32_crc32di(c, v);
+    buf += 8;
+    size -= 8;
+  }
+  crc = (uint32_t)c;
+  while (size--)
+    crc = __builtin_ia32_crc32qi(crc, *buf++);
+  return crc;
+}
+#endif
+
+uint32_t crc32c(const uint8_t *buf, uint32_t size) {
+  pthread_once(&crc32c_once, crc32c_init);
+#if defined(__x86_64__)
+  if (has_sse42)
+    return ~crc32c_hw(~0u, buf, size);
+#endif
+  return ~crc32c_sw(~0u, buf, size);
+}
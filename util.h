@@ -8,6 +8,11 @@ void set_debug_logfile(const char *filename);
 void debug_log(const char *fmt, ...);
 
 const char *sha1_sig(uint8_t *buf, uint32_t size);
+
+/* Returns the CRC32C of |size| bytes at |buf|, using the SSE4.2 instruction when
+ * the CPU has it. Unlike sha1_sig the result is returned by value rather
+ * than in a static buffer, and it is cheap enough to run on every block. */
+uint32_t crc32c(const uint8_t *buf, uint32_t size);
 uint32_t get_rand(uint32_t min, uint32_t max);
 
 #endif